@@ -0,0 +1,103 @@
+/**
+ * @file   ebbgpio.h
+ * @author Derek Molloy
+ * @date   15 December 2021
+ * @brief  The user-space interface of the button/LED LKM in practice1.c. A consumer opens /dev/ebbgpio
+ * and every read() returns a whole number of the fixed-size event records defined below. This header
+ * is shared by the module and by user-space programs, so it only uses the __u types.
+ *
+ * Any number of processes can open /dev/ebbgpio at once and every open file gets every event: the
+ * ring is shared and each file has its own position in it, starting at the newest event. The
+ * kernel never waits for a consumer. A consumer that falls more than a ring behind loses the
+ * oldest events, and in their place its next read() returns an EBBGPIO_EVENT_OVERRUN record with
+ * the number lost in duration, so a slow logger can not hold up a fast UI. A blocked read() or
+ * poll() is woken once coalesceEvents events are queued or coalesceUs after the first of them
+ * (module parameters, the default is a wakeup per event), and then takes the whole batch at once.
+ *
+ * High-rate consumers can mmap() the event ring instead of calling read(). The mapping is read-only
+ * (PROT_READ, a writable mapping fails with EPERM), starts at offset 0 and is
+ * ebbgpio_ring_ctrl.data_offset + size * slot_size bytes long: the control page, followed by the
+ * slots. A mapping consumer keeps its own position, starting at head. To consume,
+ * look at the slot at (position & (size - 1)) and load its seq with acquire semantics: once seq
+ * equals the position, copy the event, load seq again and keep the copy only if it still matches,
+ * then move on to position + 1. A seq that is behind the position (compared as a signed 32-bit
+ * difference) is an event not written yet, one that is ahead means the slot was reused and the
+ * consumer has to skip to (head - size). To block in poll() the consumer first hands its position
+ * to the kernel with lseek(fd, position, SEEK_SET); poll() reports POLLIN once the event at the
+ * position of the file is there. read() consumers can use lseek() too, SEEK_END with an offset of
+ * 0 skips to the newest event.
+ *
+ * Processes on the board, such as an agent forwarding the events elsewhere, can also join the
+ * EBBGPIO_GENL_MCGRP multicast group of the EBBGPIO_GENL_NAME generic netlink family. The module
+ * sends EBBGPIO_CMD_EVENTS messages to the group, each with a batch of the events of at most
+ * netlinkMs in one EBBGPIO_ATTR_EVENTS attribute, an array of struct ebbgpio_event. There is a
+ * single stream for all the listeners, so it can be overrun like a file (EBBGPIO_EVENT_OVERRUN).
+ *
+ * The timestamp of an event is the time the top half of its edge ran, in the clock named by
+ * ebbgpio_ring_ctrl.clock. seq numbers the edges of each button: a gap between two events of the
+ * same button are edges that produced no event (bounces, or events the consumer lost to an
+ * overrun), so the time and seq of an event are enough to compute the real latency of a
+ * consumer and to spot the losses.
+ * @see http://www.derekmolloy.ie/
+*/
+
+#ifndef EBBGPIO_H
+#define EBBGPIO_H
+
+#include <linux/types.h>
+
+#define EBBGPIO_EDGE_RISING   1          ///< The button line went from low to high (pressed)
+#define EBBGPIO_EDGE_FALLING  2          ///< The button line went from high to low (released)
+#define EBBGPIO_EVENT_SHORT   3          ///< A press shorter than longMs, not followed by a second click
+#define EBBGPIO_EVENT_LONG    4          ///< The button has been held for longMs
+#define EBBGPIO_EVENT_DOUBLE  5          ///< A second press within doubleMs of a short one
+#define EBBGPIO_EVENT_REPEAT  6          ///< Every repeatMs while a long press is held
+#define EBBGPIO_EVENT_OVERRUN 7          ///< Not a button event: duration events were lost before this point
+#define EBBGPIO_EVENT_CHORD   8          ///< The press of button completed a chord, see held for the others
+
+/** @brief One button event as returned by read() on /dev/ebbgpio */
+struct ebbgpio_event {
+   __u64 timestamp;                      ///< Time of the edge in nanoseconds, in the clock named by ebbgpio_ring_ctrl.clock
+   __u16 button;                         ///< Index of the button, 0 is button A
+   __u16 edge;                           ///< One of the EBBGPIO_EDGE_* or EBBGPIO_EVENT_* values
+   __u32 duration;                       ///< How long the button has been held in microseconds, 0 for a press
+   __u32 seq;                            ///< Per-button number of the edge, taken with timestamp
+   __u32 held;                           ///< Bit n: button n was pressed in the latest sample of all the buttons
+};
+
+#define EBBGPIO_GENL_NAME     "ebbgpio"  ///< The generic netlink family, resolve it with CTRL_CMD_GETFAMILY
+#define EBBGPIO_GENL_VERSION  1
+#define EBBGPIO_GENL_MCGRP    "events"   ///< Its multicast group
+
+/// The commands of the generic netlink family, only ever sent by the kernel
+enum { EBBGPIO_CMD_UNSPEC, EBBGPIO_CMD_EVENTS };
+
+/// The attributes of an EBBGPIO_CMD_EVENTS message
+enum {
+   EBBGPIO_ATTR_UNSPEC,
+   EBBGPIO_ATTR_EVENTS,                  ///< Binary, one or more struct ebbgpio_event
+   EBBGPIO_ATTR_CLOCK,                   ///< u32, the clock of the timestamps as in ebbgpio_ring_ctrl
+   __EBBGPIO_ATTR_MAX
+};
+#define EBBGPIO_ATTR_MAX (__EBBGPIO_ATTR_MAX - 1)
+
+/** @brief One slot of the mmap-ed event ring. seq is the ring position of the event in the slot and
+ *  is written by the kernel after the event, so the event is only valid while seq matches. */
+struct ebbgpio_slot {
+   __u32 seq;                            ///< Ring position of the event, written last
+   __u32 reserved;
+   struct ebbgpio_event event;
+};
+
+/** @brief The control page at the start of the mmap-ed ring. Positions are free-running counters */
+struct ebbgpio_ring_ctrl {
+   __u32 head;                           ///< Next position to be filled, written by the kernel only
+   __u32 reserved;                       ///< Every consumer keeps its own position
+   __u32 dropped;                        ///< Events overwritten before a read() consumer took them, summed over the files
+   __u32 size;                           ///< Number of slots, always a power of two
+   __u32 slot_size;                      ///< sizeof(struct ebbgpio_slot)
+   __u32 data_offset;                    ///< Offset of slot 0 from the start of the mapping
+   __u32 clock;                          ///< Clock of the timestamps: CLOCK_MONOTONIC or CLOCK_BOOTTIME
+};
+
+#endif
@@ -0,0 +1,118 @@
+/**
+ * @file   ebbgpio_trace.h
+ * @author Derek Molloy
+ * @date   15 December 2021
+ * @brief  Tracepoints of the button/LED LKM in practice1.c. They cost a patched-out branch when
+ * disabled, so they can stay in the IRQ path where a printk per interrupt could not. Enable them with
+ * e.g. echo 1 > /sys/kernel/tracing/events/ebbgpio/enable. As the header lives next to the module
+ * source, the Makefile adds CFLAGS_practice1.o := -I$(src) for define_trace.h to find it.
+ * @see http://www.derekmolloy.ie/
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ebbgpio
+
+#if !defined(_EBBGPIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EBBGPIO_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/** @brief Entry to the top half, time and seq are the edge timestamp and number taken on entry */
+TRACE_EVENT(ebbgpio_irq,
+   TP_PROTO(unsigned int button, unsigned int irq, ktime_t time, u32 seq),
+   TP_ARGS(button, irq, time, seq),
+   TP_STRUCT__entry(
+      __field(unsigned int, button)
+      __field(unsigned int, irq)
+      __field(s64, time)
+      __field(u32, seq)
+   ),
+   TP_fast_assign(
+      __entry->button = button;
+      __entry->irq    = irq;
+      __entry->time   = ktime_to_ns(time);
+      __entry->seq    = seq;
+   ),
+   TP_printk("button=%c irq=%u time=%lld seq=%u", 'A' + __entry->button, __entry->irq, __entry->time, __entry->seq)
+);
+
+/** @brief The software debounce engine accepted or rejected an edge after re-sampling the line */
+TRACE_EVENT(ebbgpio_debounce,
+   TP_PROTO(unsigned int button, bool accepted, int level),
+   TP_ARGS(button, accepted, level),
+   TP_STRUCT__entry(
+      __field(unsigned int, button)
+      __field(bool, accepted)
+      __field(int, level)
+   ),
+   TP_fast_assign(
+      __entry->button   = button;
+      __entry->accepted = accepted;
+      __entry->level    = level;
+   ),
+   TP_printk("button=%c %s level=%d", 'A' + __entry->button,
+             __entry->accepted ? "accept" : "reject", __entry->level)
+);
+
+/** @brief An LED GPIO was written */
+TRACE_EVENT(ebbgpio_led,
+   TP_PROTO(unsigned int led, bool on),
+   TP_ARGS(led, on),
+   TP_STRUCT__entry(
+      __field(unsigned int, led)
+      __field(bool, on)
+   ),
+   TP_fast_assign(
+      __entry->led = led;
+      __entry->on  = on;
+   ),
+   TP_printk("led=%u %s", __entry->led, __entry->on ? "on" : "off")
+);
+
+/** @brief The bottom half handled a press, latency is the time since the edge in ns */
+TRACE_EVENT(ebbgpio_dispatch,
+   TP_PROTO(unsigned int button, int state, s64 latency, bool helper),
+   TP_ARGS(button, state, latency, helper),
+   TP_STRUCT__entry(
+      __field(unsigned int, button)
+      __field(int, state)
+      __field(s64, latency)
+      __field(bool, helper)
+   ),
+   TP_fast_assign(
+      __entry->button  = button;
+      __entry->state   = state;
+      __entry->latency = latency;
+      __entry->helper  = helper;
+   ),
+   TP_printk("button=%c state=%d latency=%lldns helper=%d", 'A' + __entry->button,
+             __entry->state, __entry->latency, __entry->helper)
+);
+
+/** @brief A button entered (polling=1) or left (polling=0) the polling mode used during IRQ storms.
+ *  count is the number of IRQs in the last rate window on entry, and the number of polls on exit */
+TRACE_EVENT(ebbgpio_storm,
+   TP_PROTO(unsigned int button, bool polling, unsigned int count),
+   TP_ARGS(button, polling, count),
+   TP_STRUCT__entry(
+      __field(unsigned int, button)
+      __field(bool, polling)
+      __field(unsigned int, count)
+   ),
+   TP_fast_assign(
+      __entry->button  = button;
+      __entry->polling = polling;
+      __entry->count   = count;
+   ),
+   TP_printk("button=%c %s count=%u", 'A' + __entry->button,
+             __entry->polling ? "polling" : "irq", __entry->count)
+);
+
+#endif /* _EBBGPIO_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ebbgpio_trace
+#include <trace/define_trace.h>
@@ -2,10 +2,22 @@
  * @file   practice1.c
  * @author Derek Molloy
  * @date   15 December 2021
- * @brief  A kernel module for controlling a GPIO LED/button pair. The device mounts devices via
- * sysfs /sys/class/gpio/gpio115 and gpio49. Therefore, this test LKM circuit assumes that an LED
- * is attached to GPIO 49 which is on P9_23 and the button is attached to GPIO 115 on P9_27. There
- * is no requirement for a custom overlay, as the pins are in their default mux mode states.
+ * @brief  A kernel module for controlling GPIO LEDs from a table of GPIO buttons. What a press does
+ * is set by a table of rules that can be changed at run time through /sys/class/ebbgpio/rules: turn
+ * LEDs on, off or toggle them, pulse them, queue an event on /dev/ebbgpio or run the button script.
+ * Both edges are captured, so the rules can fire on presses, releases and on the short, long, double
+ * click and repeat gestures recognised in the kernel. All the buttons are sampled together with one
+ * array read, so a rule can also fire on a chord of buttons held at once.
+ * The default table is a pair of LEDs on GPIO14/GPIO15 and four buttons A-D, all given as module
+ * parameter arrays, so the same single IRQ handler serves any number of inputs. There is no
+ * requirement for a custom overlay, as the pins are in their default mux mode states.
+ * The module is a platform driver. A device tree node can describe the table instead, e.g.
+ *    ebbgpio { compatible = "derekmolloy,ebbgpio"; led-gpios = <&gpio 14 0>, <&gpio 15 0>;
+ *              button-gpios = <&gpio 8 0>, <&gpio 7 0>, <&gpio 23 0>, <&gpio 24 0>; };
+ * and without one the module creates its own device from the parameters. Buttons and LEDs can then
+ * be added, removed and moved to other GPIOs live through /sys/kernel/config/ebbgpio.
+ * Every trigger first goes through ebbgpio_filter_event(), which does nothing but can be overridden
+ * by a BPF program to drop or rewrite events in the kernel, see the function.
  * @see http://www.derekmolloy.ie/
 */
  
@@ -13,211 +25,3500 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/gpio.h>                 // Required for the GPIO functions
+#include <linux/gpio/consumer.h>        // Required for the GPIO descriptors and the array writes
+#include <linux/gpio/driver.h>          // The controller of an LED, for mmioLeds=1
+#include <linux/of_address.h>
+#include <linux/io.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>             // Required for the rule table
+#include <linux/ctype.h>
 #include <linux/interrupt.h>            // Required for the IRQ code
+#include <linux/cpumask.h>              // Required for the IRQ and thread placement
+#include <linux/ktime.h>                // Required for the edge timestamps
+#include <linux/sched.h>                // Required to tune the IRQ thread priority
+#include <uapi/linux/sched/types.h>     // struct sched_attr
+#include <linux/miscdevice.h>           // Required for the /dev/ebbgpio character device
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>               // Required for the lock-free event ring
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>              // The ring lives in vmalloc memory so it can be mmap-ed
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/hrtimer.h>              // Required for the software debounce engine
+#include <linux/wait.h>
+#include <linux/workqueue.h>            // Required for the script dispatch queue
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/percpu.h>               // Required for the per-CPU press counters
+#include <linux/seqlock.h>              // Required for the consistent counter snapshots
+#include <linux/device.h>               // Required for /sys/class/ebbgpio
+#include <linux/debugfs.h>              // Required for the latency histograms
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+#include <linux/ratelimit.h>
+#include <linux/platform_device.h>     // The module is a platform driver
+#include <linux/of.h>
+#include <linux/input.h>                 // Required for the optional input device
+#include <linux/pm_wakeup.h>              // Required for the wake-up IRQs of the buttons
+#include <linux/configfs.h>                // Required to add, remove and rebind buttons and LEDs live
+#include <linux/kthread.h>              // Required for the bench=1 edge injector
+#include <linux/error-injection.h>      // Lets a BPF program override the event filter
+#include <net/genetlink.h>              // Required for the event multicast group
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+#include <linux/irq_sim.h>
+#include <linux/irqdomain.h>
+#endif
+#include "ebbgpio.h"                    // The event record shared with user space
+#define CREATE_TRACE_POINTS
+#include "ebbgpio_trace.h"              // The tracepoints of the IRQ path
  
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Derek Molloy");
 MODULE_DESCRIPTION("A Button/LED test driver for the BBB");
 MODULE_VERSION("0.1");
- 
-static unsigned int gpioLED1 = 14;       ///< hard coding the LED gpio to pin 8 (GPIO14)
-static unsigned int gpioLED2 = 15;	///< hard coding the second LED gpio to pin 10 (GPIO15)
-static unsigned int gpioButtonA = 8;	///< hard coding the button A gpio to pin 16 (GPIO23)
-static unsigned int gpioButtonB = 7;	///< hard coding the button B gpio to pin 18 (GPIO24)
-static unsigned int gpioButtonC = 23;	///< hard coding the button C gpio to pin 24 (GPIO8)
-static unsigned int gpioButtonD = 24;   ///< hard coding the button D gpio to pin 26 (GPIO7)
-static unsigned int irqNumberA;          ///< Used to share the IRQ number within this file
-static unsigned int irqNumberB;
-static unsigned int irqNumberC;
-static unsigned int irqNumberD;
-static unsigned int numberPressesA = 0;  ///< For information, store the number of button A presses
-static unsigned int numberPressesB = 0;	///< For information, store the number of button B presses
-static unsigned int numberPressesC = 0;	///< For information, store the number of button C presses
-static unsigned int numberPressesD = 0;	///< For information, store the number of button D presses
-static bool     led1On = 0;          ///< Is the LED 1 on or off? Used to invert its state (off by default)
-static bool	led2On = 0;	     ///< Is the LED 2 on or off?
-static char *argv1[] = {"/usr/bin/buttonScripts/buttonA.sh", NULL};
-static char *argv2[] = {"/usr/bin/buttonScripts/buttonB.sh", NULL};
-static char *argv3[] = {"/usr/bin/buttonScripts/buttonC.sh", NULL};
-static char *argv4[] = {"/usr/bin/buttonScripts/buttonD.sh", NULL};
-static char *envp[] = {"HOME=/", NULL};
+
+#define EBBGPIO_MAX_BUTTONS 26       ///< Buttons are named A-Z in the log and in the script names
+#define EBBGPIO_MAX_LEDS    32
+
+/// The LED and button GPIOs. The defaults are the Raspberry Pi wiring: LEDs on GPIO14 (pin 8) and GPIO15
+/// (pin 10), buttons A-D on GPIO8 (pin 24), GPIO7 (pin 26), GPIO23 (pin 16) and GPIO24 (pin 18)
+static unsigned int ledGpios[EBBGPIO_MAX_LEDS] = {14, 15};
+static int numLeds = 2;
+module_param_array_named(leds, ledGpios, uint, &numLeds, S_IRUGO);
+MODULE_PARM_DESC(leds, " GPIO numbers of the LEDs (default=14,15)");
+
+static unsigned int buttonGpios[EBBGPIO_MAX_BUTTONS] = {8, 7, 23, 24};
+static int numButtons = 4;
+module_param_array_named(buttons, buttonGpios, uint, &numButtons, S_IRUGO);
+MODULE_PARM_DESC(buttons, " GPIO numbers of the buttons A, B, C... (default=8,7,23,24)");
+
+static int buttonLeds[EBBGPIO_MAX_BUTTONS] = {0, 0, 1, 1, [4 ... EBBGPIO_MAX_BUTTONS - 1] = -1};
+module_param_array_named(buttonLed, buttonLeds, int, NULL, S_IRUGO);
+MODULE_PARM_DESC(buttonLed, " Index of the LED driven by each button in the default rules, -1 for none (default=0,0,1,1)");
+
+static char *buttonActions[EBBGPIO_MAX_BUTTONS] = {"on", "off", "on", "off"};
+module_param_array_named(buttonAction, buttonActions, charp, NULL, S_IRUGO);
+MODULE_PARM_DESC(buttonAction, " What each button does to its LED in the default rules: on, off, toggle or none (default=on,off,on,off)");
+
+static char *buttonScripts[EBBGPIO_MAX_BUTTONS];  ///< Empty entries use /usr/bin/buttonScripts/buttonX.sh
+module_param_array_named(buttonScript, buttonScripts, charp, NULL, S_IRUGO);
+MODULE_PARM_DESC(buttonScript, " Script run by the script rules of each button (default=/usr/bin/buttonScripts/buttonX.sh)");
+
+static bool mmioLeds = false;        ///< Write the LEDs of a known GPIO controller straight to its registers
+module_param(mmioLeds, bool, S_IRUGO);
+MODULE_PARM_DESC(mmioLeds, " Write the LEDs on a BCM2835/BCM2711 GPIO controller to its set/clear registers instead of through gpiolib, compare the led latency histograms (default=0)");
+
+static bool inputDev = false;        ///< Also report the buttons as keys of an input device
+module_param(inputDev, bool, S_IRUGO);
+MODULE_PARM_DESC(inputDev, " Register the buttons as an input device, so evdev readers get EV_KEY events (default=0)");
+
+/// 0 entries use BTN_TRIGGER_HAPPY1 + index, from BTN_TRIGGER_HAPPY5 on for the buttons E-Z
+static unsigned int buttonKeys[EBBGPIO_MAX_BUTTONS] = {BTN_0, BTN_1, BTN_2, BTN_3};
+module_param_array_named(buttonKey, buttonKeys, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(buttonKey, " Key code reported by each button with inputDev=1 (default=BTN_0,BTN_1,BTN_2,BTN_3,BTN_TRIGGER_HAPPY5..)");
+
+static char *clockName = "monotonic";    ///< The clock of the event timestamps
+module_param_named(clock, clockName, charp, S_IRUGO);
+MODULE_PARM_DESC(clock, " Clock of the event and script timestamps: monotonic or boottime, which also counts suspend (default=monotonic)");
+
+static bool threaded = true;         ///< Split each handler into a hard-IRQ top half and an IRQ thread
+module_param(threaded, bool, S_IRUGO);
+MODULE_PARM_DESC(threaded, " Use request_threaded_irq so the slow work runs in an IRQ thread (default=1)");
+
+static int irqPriority = MAX_RT_PRIO / 2;  ///< SCHED_FIFO priority of the IRQ threads (kernel default is 50)
+module_param(irqPriority, int, S_IRUGO);
+MODULE_PARM_DESC(irqPriority, " SCHED_FIFO priority of the button IRQ threads, 1-99 (default=50)");
+
+/// The CPUs of the button IRQs and of the IRQ threads and scripts, empty for the kernel defaults.
+/// Both can be changed at run time through /sys/module/<module>/parameters.
+static struct cpumask irqCpuMask;
+static struct cpumask threadCpuMask;
+static DEFINE_MUTEX(affinityLock);   ///< Serialises the affinity changes against the button setup
+static void ebbgpio_affinity_apply(void);
+
+/** @brief Set irqCpus or threadCpus from a CPU list such as "2-3", and apply it to the live buttons
+ *  @param val the CPU list, empty for the kernel defaults
+ *  @param kp  the parameter, its arg is the mask
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_cpus_set(const char *val, const struct kernel_param *kp){
+   cpumask_var_t mask;
+   int result;
+   if (!alloc_cpumask_var(&mask, GFP_KERNEL)) return -ENOMEM;
+   result = cpulist_parse(val, mask);
+   if (!result){
+      mutex_lock(&affinityLock);             // The IRQ threads and the scripts read it at any time
+      cpumask_copy(kp->arg, mask);
+      mutex_unlock(&affinityLock);
+      ebbgpio_affinity_apply();
+   }
+   free_cpumask_var(mask);
+   return result;
+}
+
+static int ebbgpio_cpus_get(char *buffer, const struct kernel_param *kp){
+   int len;
+   mutex_lock(&affinityLock);
+   len = sprintf(buffer, "%*pbl\n", cpumask_pr_args((struct cpumask *) kp->arg));
+   mutex_unlock(&affinityLock);
+   return len;
+}
+
+static const struct kernel_param_ops ebbgpio_cpus_ops = {
+   .set = ebbgpio_cpus_set,
+   .get = ebbgpio_cpus_get,
+};
+module_param_cb(irqCpus, &ebbgpio_cpus_ops, &irqCpuMask, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(irqCpus, " CPU list for the button IRQs, buttonX/irq_affinity overrides it (default=kernel)");
+module_param_cb(threadCpus, &ebbgpio_cpus_ops, &threadCpuMask, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(threadCpus, " CPU list for the IRQ threads and the button scripts (default=that of the IRQ)");
+
+static bool useHelper = false;       ///< Also fork the buttonX.sh scripts, for consumers not yet using /dev/ebbgpio
+module_param(useHelper, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(useHelper, " Let the script rules run the button scripts (default=0)");
+
+static unsigned int maxScripts = 2;  ///< The concurrency cap of the script dispatch workqueue
+module_param(maxScripts, uint, S_IRUGO);
+MODULE_PARM_DESC(maxScripts, " Number of button scripts that may run at the same time (default=2)");
+
+static unsigned int scriptDepth = 4; ///< Runs of one button's script that may wait with scriptPolicy=queue
+module_param(scriptDepth, uint, S_IRUGO);
+MODULE_PARM_DESC(scriptDepth, " Runs of each button script that may be queued (default=4)");
+
+static char *scriptPolicy = "coalesce";
+module_param(scriptPolicy, charp, S_IRUGO);
+MODULE_PARM_DESC(scriptPolicy, " What a press does while its button script is busy: drop, coalesce or queue (default=coalesce)");
+
+static int verbose = 1;              ///< 0 = quiet, 1 = a line per press, 2 = also the rejected glitches
+module_param(verbose, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(verbose, " Log level of the IRQ path, always ratelimited: 0 quiet, 1 presses, 2 also glitches (default=1)");
+
+static bool bothEdges = true;        ///< Also interrupt on the release, needed for the press length and the gestures
+module_param(bothEdges, bool, S_IRUGO);
+MODULE_PARM_DESC(bothEdges, " Interrupt on both edges so releases and gestures are seen (default=1)");
+
+static unsigned int longMs = 1000;   ///< A press held this long is a long press
+module_param(longMs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(longMs, " Time a button must be held for a long press in ms (default=1000)");
+
+static unsigned int doubleMs = 300;  ///< A second press this soon after a short one is a double click
+module_param(doubleMs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(doubleMs, " Longest gap between the clicks of a double click in ms, 0 disables them (default=300)");
+
+static unsigned int repeatMs = 250;  ///< Interval of the repeat events while a long press is held
+module_param(repeatMs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(repeatMs, " Interval of the repeat events of a held long press in ms, 0 disables them (default=250)");
+
+static unsigned int stormRate = 1000; ///< IRQs per second of one button that make it a storm, 0 never
+module_param(stormRate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(stormRate, " IRQ rate of a button that switches it to polling, 0 disables it (default=1000/s)");
+
+static unsigned int pollMs = 10;     ///< Sampling period of the buttons in polling mode
+module_param(pollMs, uint, S_IRUGO);
+MODULE_PARM_DESC(pollMs, " Sampling period of the buttons switched to polling in ms (default=10)");
+
+static unsigned int quietMs = 1000;  ///< A polled button this long without a change gets its IRQ back
+module_param(quietMs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(quietMs, " Time a polled button must be stable before its IRQ is enabled again in ms (default=1000)");
+
+static bool bench = false;           ///< Drive the pipeline from simulated IRQs instead of the GPIOs
+module_param(bench, bool, S_IRUGO);
+MODULE_PARM_DESC(bench, " Benchmark mode: the buttons are irq_sim lines fed by an edge injector, no GPIO is used (default=0)");
+
+static unsigned int benchEdges = 1000000;   ///< Number of edges injected by bench=1
+module_param(benchEdges, uint, S_IRUGO);
+MODULE_PARM_DESC(benchEdges, " Number of edges injected with bench=1, spread over the buttons (default=1000000)");
+
+static unsigned int benchRate = 100000;     ///< Injection rate of bench=1 in edges per second, 0 flat out
+module_param(benchRate, uint, S_IRUGO);
+MODULE_PARM_DESC(benchRate, " Edges per second injected with bench=1, 0 for as fast as possible (default=100000)");
+
+static bool benchStress = false;     ///< bench=1 runs the stress phases instead of the throughput run
+module_param(benchStress, bool, S_IRUGO);
+MODULE_PARM_DESC(benchStress, " With bench=1, run the bounce, stuck, all-CPU and stalled reader stress phases and check the pipeline instead (default=0)");
+
+static unsigned int debounceUs[EBBGPIO_MAX_BUTTONS] = {[0 ... EBBGPIO_MAX_BUTTONS - 1] = 5000};
+module_param_array(debounceUs, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(debounceUs, " Debounce window of each button in microseconds, 0 disables it (default=5000)");
+
+/// What a rule does when it fires. The first four are also the values of the buttonAction parameter
+enum { EBBGPIO_ACTION_NONE, EBBGPIO_ACTION_ON, EBBGPIO_ACTION_OFF, EBBGPIO_ACTION_TOGGLE,
+       EBBGPIO_ACTION_PULSE, EBBGPIO_ACTION_EVENT, EBBGPIO_ACTION_SCRIPT };
+static const char *const ebbgpio_action_names[] = {"none", "on", "off", "toggle", "pulse", "event", "script"};
+/// What a rule fires on. The event queued for trigger n has the edge value n + 1 of ebbgpio.h, chord
+/// excepted (see ebbgpio_trigger_edge()). Any is every trigger of the button but chord, which only
+/// chord rules fire on
+enum { EBBGPIO_TRIG_PRESS, EBBGPIO_TRIG_RELEASE, EBBGPIO_TRIG_SHORT, EBBGPIO_TRIG_LONG,
+       EBBGPIO_TRIG_DOUBLE, EBBGPIO_TRIG_REPEAT, EBBGPIO_TRIG_CHORD, EBBGPIO_TRIG_ANY };
+static const char *const ebbgpio_trigger_names[] = {"press", "release", "short", "long", "double", "repeat", "chord",
+                                                    "any"};
+#define EBBGPIO_MAX_RULES   128
+
+/// What happens to a script rule that fires while the script of the button is still queued or running
+enum { EBBGPIO_POLICY_DROP, EBBGPIO_POLICY_COALESCE, EBBGPIO_POLICY_QUEUE };
+static const char *const ebbgpio_policy_names[] = {"drop", "coalesce", "queue"};
+static int dispatchPolicy;           ///< scriptPolicy as one of the EBBGPIO_POLICY_* values
+static struct workqueue_struct *dispatchWq;   ///< Runs the button scripts, at most maxScripts at once
+
+/** @brief The script dispatch stage of one button. The IRQ path only counts the request and queues
+ *  the work, the work runs the script and waits for it to exit, so the scripts can neither pile up
+ *  behind a bouncing button nor run more than maxScripts at a time. The work of a button never runs
+ *  twice at once, so its runs are serialised and count is only used by one run at a time. */
+struct ebbgpio_dispatch {
+   struct work_struct work;
+   atomic_t pending;                 ///< Runs not started yet, or presses folded into the next run
+   atomic_t running;                 ///< 1 while the script of the button is running
+   atomic_t dropped;                 ///< Presses whose run was dropped
+   char count[12];                   ///< Second argument of the script with scriptPolicy=coalesce
+   raw_spinlock_t lock;              ///< Protects time and seq, a u64 is not atomic on every CPU
+   u64 time;                         ///< Timestamp of the latest press handed to the dispatcher
+   u32 seq;                          ///< and the sequence number of its edge
+   char envTime[40];                 ///< EBBGPIO_TIME=, the environment of the script
+   char envSeq[24];                  ///< EBBGPIO_SEQ=
+   char *envp[4];
+};
+
+/** @brief One rule: when trigger happens on button, do action (to the LEDs in leds, for ms) */
+struct ebbgpio_rule {
+   u8 button;                        ///< Index of the button, 0 is button A, the first one of a chord
+   u8 trigger;                       ///< One of the EBBGPIO_TRIG_* values
+   u8 action;                        ///< One of the EBBGPIO_ACTION_* values
+   unsigned long leds;               ///< The LEDs of the on, off, toggle and pulse actions
+   unsigned int ms;                  ///< Length of a pulse
+   unsigned long chord;              ///< The buttons of a chord rule, 0 for the other triggers
+};
+
+/** @brief The rule table. The IRQ path only reads it under RCU, so a change through sysfs builds a
+ *  new table and swaps the pointer, and the old one is freed once no handler can be using it. */
+struct ebbgpio_rules {
+   struct rcu_head rcu;
+   unsigned int count;
+   struct ebbgpio_rule rule[];
+};
+static struct ebbgpio_rules __rcu *ruleTable;
+static DEFINE_MUTEX(ruleLock);       ///< Serialises the writers of ruleTable
+
+/** @brief State of the software debounce engine of one button. It is only used when the GPIO
+ *  controller cannot debounce in hardware (gpio_set_debounce fails, as it does on the BCM2835). */
+struct ebbgpio_debounce {
+   struct hrtimer timer;             ///< Expires at the end of each debounce window
+   ktime_t window;                   ///< Length of the window
+   ktime_t edgeTime;                 ///< Time of the first edge of the press or release being debounced
+   int state;                        ///< One of the DEBOUNCE_* values below
+   bool soft;                        ///< Debounce in software, the hardware could not do it
+};
+/// Idle, the first edge of a press, the press accepted, and the first edge of its release (bothEdges=1)
+enum { DEBOUNCE_IDLE, DEBOUNCE_EDGE, DEBOUNCE_HELD, DEBOUNCE_UP };
+
+/** @brief The gesture state machine of one button, fed with the debounced presses and releases.
+ *  The timer ends each state: the long press threshold, the repeat interval or the double click
+ *  gap. The edges and the timer can run on different CPUs, so the state is kept under lock, and
+ *  deadline lets a timer that lost the race with an edge see that it is stale. */
+struct ebbgpio_gesture {
+   raw_spinlock_t lock;
+   struct hrtimer timer;
+   ktime_t deadline;                 ///< When the timer is due for the current state
+   ktime_t pressTime;                ///< Start of the current (or last) press
+   u32 duration;                     ///< Length of the last short press in microseconds
+   int state;                        ///< One of the GESTURE_* values below
+};
+enum { GESTURE_IDLE, GESTURE_DOWN, GESTURE_LONG, GESTURE_UP, GESTURE_DOWN2 };
+
+/** @brief The storm detector of one button. The top half counts its IRQs in fixed windows; past
+ *  stormRate the IRQ is disabled and the button is sampled by pollTimer instead, so a noisy wire
+ *  costs a sample per pollMs instead of livelocking the CPU. The IRQ is enabled again once the
+ *  line has been stable for quietMs. Whoever clears polling owns the enable_irq(). */
+struct ebbgpio_storm {
+   ktime_t windowStart;              ///< Start of the current rate window, top half only
+   unsigned int count;               ///< IRQs in the current window, top half only
+   bool polling;                     ///< The IRQ is disabled, pollTimer samples the button
+   ktime_t lastChange;               ///< Last time polling saw the line change
+   unsigned int polls;               ///< Samples taken in the current polling period
+   unsigned int storms;              ///< Times the button switched to polling
+};
+#define EBBGPIO_STORM_WINDOW_MS 100  ///< Length of the rate windows of the storm detector
+
+/// The stages of the latency histograms, all measured from the edge timestamp taken by the top half
+/// irq is only measured with bench=1, from the injection of the edge to the top half
+enum { EBBGPIO_LAT_IRQ, EBBGPIO_LAT_LED, EBBGPIO_LAT_DISPATCH, EBBGPIO_LAT_READ, EBBGPIO_LAT_STAGES };
+static const char *const ebbgpio_lat_names[] = {"irq", "led", "dispatch", "read"};
+#define EBBGPIO_LAT_BUCKETS 32       ///< Bucket n counts latencies of 2^(n-1) to 2^n - 1 ns, the last one is open
+
+enum { EBBGPIO_STAT_PRESSES, EBBGPIO_STAT_REJECTS, EBBGPIO_STAT_SPURIOUS, EBBGPIO_STAT_LAUNCHES,
+       EBBGPIO_STAT_FAILURES, EBBGPIO_STAT_FILTERED, EBBGPIO_STATS };
+static const char *const ebbgpio_stat_names[] = {"presses", "rejects", "spurious", "launches", "failures", "filtered"};
+
+/** @brief The per-CPU counters of one button. Each CPU only ever writes its own copy, so the IRQ
+ *  path takes no lock and shares no cache line with the other CPUs; readers add up all the copies.
+ *  Every update of count or maxLatency is wrapped in seq with the local IRQs off, so the writers of
+ *  a CPU never nest and a reader that retries on seq gets all the counters of a CPU from the same
+ *  instant, on 64-bit CPUs as well. The histogram buckets are 32-bit and bumped with
+ *  this_cpu_inc(), which is safe against the IRQ path. */
+struct ebbgpio_stats {
+   seqcount_t seq;
+   u64 count[EBBGPIO_STATS];         ///< Indexed by EBBGPIO_STAT_*
+   u64 maxLatency[EBBGPIO_LAT_STAGES];  ///< Worst sample of each stage in ns
+   u32 latency[EBBGPIO_LAT_STAGES][EBBGPIO_LAT_BUCKETS];
+};
+
+/** @brief A snapshot of the counters of one button, summed over the CPUs (the max for the latencies) */
+struct ebbgpio_snapshot {
+   u64 count[EBBGPIO_STATS];
+   u64 maxLatency[EBBGPIO_LAT_STAGES];
+};
+
+/** @brief A configfs item, either buttons/X (X is A-Z) or leds/N (N is 0-31). Creating it adopts the
+ *  slot of that button or LED, whether it is up or not, and removing it takes the slot down. */
+struct ebbgpio_cfg {
+   struct config_item item;
+   unsigned int index;               ///< Index of the button or of the LED
+   char script[256];                 ///< buttons only: replaces buttonScript when not empty
+};
+
+/** @brief Everything the IRQ path needs to know about one button. The IRQ handlers get their button
+ *  through dev_id, so all the buttons share one handler and each one only touches its own cache
+ *  line(s) -- buttons pressed on different CPUs never bounce a line between them. */
+struct ebbgpio_button {
+   unsigned int index;               ///< Position in the table, 0 is button A
+   unsigned int gpio;
+   struct gpio_desc *desc;           ///< The descriptor of gpio, used by the IRQ path
+   unsigned int irq;
+   unsigned long deferred;           ///< Bit n set: action n was left to the IRQ thread
+   raw_spinlock_t edgeLock;          ///< Protects pressTime and seq for the readers outside the top half
+   ktime_t pressTime;                ///< Edge time captured by the top half, read by the thread
+   u32 seq;                          ///< Number of edges seen, bumped with pressTime by the top half
+   struct ebbgpio_stats __percpu *stats;
+   struct device *dev;               ///< /sys/class/ebbgpio/buttonX
+   struct dentry *debugfs;           ///< <debugfs>/ebbgpio/buttonX
+   char *argv[3];                    ///< The script run by the usermode helper, and its count argument
+   struct ebbgpio_dispatch dispatch;
+   struct ebbgpio_debounce debounce;
+   bool down;                        ///< The debounced state of the button
+   bool releases;                    ///< The releases are seen, by an IRQ or by the debounce timer
+   struct ebbgpio_gesture gesture;
+   struct ebbgpio_storm storm;
+   struct cpumask affinity;          ///< The affinity hint of the IRQ, under affinityLock
+   bool ownAffinity;                 ///< affinity was set through irq_affinity, not from irqCpus
+   bool affine;                      ///< The IRQ is requested, its affinity can be set
+   bool up;                          ///< The button is running, under configLock
+   bool fw;                          ///< The GPIO is button-gpios[index] of the device tree node
+   struct ebbgpio_cfg *cfg;          ///< Its buttons/X item in configfs, if any, under configLock
+   bool wake;                        ///< The IRQ is armed to wake the system up
+   bool wakeArmed;                   ///< No edge since the suspend, the next one may have woken us
+   int simLevel;                     ///< bench=1: the level of the simulated line
+   ktime_t simTime;                  ///< bench=1: when the last edge was injected
+} ____cacheline_aligned_in_smp;
+
+static struct ebbgpio_button buttons[EBBGPIO_MAX_BUTTONS];
+/** The LEDs are written as one array: on a controller with set_multiple() that is one register write
+ *  for all the LEDs, so a pattern never shows half-applied. The array holds the LEDs of ledMask, the
+ *  ones that are up, so LEDs can come and go through configfs without a gap in it. ledOn is the logical state, one bit per
+ *  LED, and is only changed with cmpxchg. A change that leaves it as it was (a bouncing button that
+ *  keeps turning its LED on) costs no lock and no GPIO write. ledWritten is what the GPIOs were last
+ *  set to; ledLock serialises the writes so the last one always carries the latest ledOn. */
+static struct gpio_desc *ledDescs[EBBGPIO_MAX_LEDS];
+static unsigned long ledOn;          ///< Is each LED on or off? EBBGPIO_MAX_LEDS fits in one long
+static unsigned long ledWritten;     ///< The state last written to the GPIOs, under ledLock
+static unsigned long ledMask;        ///< One bit for each LED that is up, changed under ledLock
+static unsigned long ledFw;          ///< The LEDs whose GPIO is led-gpios[n] of the device tree node
+/** With mmioLeds=1 an LED on a controller of ebbgpio_mmio_ids skips gpiolib (the descriptor checks,
+ *  the chip lookup and the set_multiple() callback): its bit goes straight into the set or clear
+ *  register of the controller, so the top half writes it with one or two MMIO stores. */
+static unsigned long ledFast;        ///< The LEDs written through ledRegs, changed under ledLock
+static u8 ledHw[EBBGPIO_MAX_LEDS];   ///< The line of each LED of ledFast on its controller
+static void __iomem *ledRegs;        ///< The registers of that controller, mapped for the first such LED
+static struct device_node *ledRegsNode;  ///< and its node, the LEDs of any other controller use gpiolib
+#define BCM2835_GPSET0  0x1c         ///< Writing 1 to bit n of GPSET0 + 4 * (n / 32) sets line n
+#define BCM2835_GPCLR0  0x28         ///< and of GPCLR0 clears it, the 0 bits leave the other lines alone
+#define BCM2835_NGPIO   54
+static unsigned long ledSaved;       ///< The LED state across a system suspend, the LEDs are off meanwhile
+static bool ledRestore;              ///< ledSaved is still to be put back, the suspend got to the LEDs
+static DEFINE_RAW_SPINLOCK(ledLock);  ///< Raw, the LEDs are written from hard-IRQ context
+/** The buttons are read the same way: every sample of a line reads all the buttons of bankMask with
+ *  one array read (one register read per controller with get_multiple()), so bankHeld is a coherent
+ *  picture of which buttons are held at once, as the chord rules need, not four racing reads. */
+static unsigned long bankMask;       ///< One bit for each button whose line can be sampled, under bankLock
+static unsigned long bankHeld;       ///< The buttons found pressed by the latest sample
+static DEFINE_RAW_SPINLOCK(bankLock);  ///< Keeps the descriptors of bankMask alive during a sample
+static struct hrtimer ledPulse[EBBGPIO_MAX_LEDS];  ///< Ends the pulse of each LED
+static struct hrtimer pollTimer;     ///< Samples the buttons that are in polling mode
+static atomic_t pollingButtons;      ///< Number of buttons in polling mode, pollTimer runs while > 0
+static struct class *ebbgpioClass;   ///< /sys/class/ebbgpio, one device per button
+static struct dentry *ebbgpioDebugfs;  ///< <debugfs>/ebbgpio, the latency histograms
+static struct device *ebbgpioDev;    ///< The bound ebbgpio device, the driver state is global
+static struct platform_device *ebbgpioPdev;  ///< The device created without a device tree node
+static struct input_dev *ebbgpioInput;  ///< The input device of inputDev=1, NULL otherwise
+/** The key edges on their way to the input device. The edges come from hard-IRQ context (the top
+ *  half and the HARD hrtimers), where the input core can not be called on PREEMPT_RT: its event_lock
+ *  is a spinlock_t, which sleeps there. So they are queued under a raw lock and inputWork reports
+ *  them in order, each with its own edge time. */
+#define EBBGPIO_INPUT_QUEUE 64
+struct ebbgpio_key_edge {
+   ktime_t time;                     ///< The time of the edge
+   unsigned int button;              ///< The index of the button
+   bool down;                        ///< A press, else a release
+   bool click;                       ///< A press without a release to come, reported as both
+};
+static struct ebbgpio_key_edge inputQueue[EBBGPIO_INPUT_QUEUE];
+static unsigned int inputHead, inputTail;  ///< Free-running positions in inputQueue, under inputLock
+static bool inputOverflow;           ///< Edges were lost, inputWork reports the state of every key
+static DEFINE_RAW_SPINLOCK(inputLock);
+static void ebbgpio_input_work(struct work_struct *work);
+static DECLARE_WORK(inputWork, ebbgpio_input_work);
+static bool useBoottime;             ///< clock=boottime
+static bool ebbgpioReady;            ///< The probe is done, configfs may bring slots up, under configLock
+/// Serialises bringing buttons and LEDs up and down. Only the slot being changed stops, the IRQs of
+/// the others keep running.
+static DEFINE_MUTEX(configLock);
+
+static unsigned int ringSize = 256;  ///< Number of events the ring can hold, rounded up to a power of two
+module_param(ringSize, uint, S_IRUGO);
+MODULE_PARM_DESC(ringSize, " Number of events in the /dev/ebbgpio ring, 16-65536 (default=256)");
+
+static unsigned int coalesceEvents = 1;  ///< Wake the readers once this many events are queued
+module_param(coalesceEvents, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesceEvents, " Wake the /dev/ebbgpio readers once this many events are queued, 1 wakes them for every event (default=1)");
+
+static unsigned int coalesceUs = 1000;   ///< or once the oldest of them has waited this long
+module_param(coalesceUs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesceUs, " Wake the /dev/ebbgpio readers at the latest this long after an event in us, 0 wakes them for every event (default=1000)");
+
+static unsigned int netlinkMs = 10;  ///< How long the events wait to be batched for netlink, 0 disables it
+module_param(netlinkMs, uint, S_IRUGO);
+MODULE_PARM_DESC(netlinkMs, " Batch the events sent to the ebbgpio netlink group for up to this many ms, 0 for no netlink family (default=10)");
+
+/** @brief The event ring shared by all the buttons. Every IRQ handler is a producer: it reserves
+ *  a position by advancing head with cmpxchg, fills the slot and then publishes it through the slot
+ *  seq (see ebbgpio.h), so a consumer only trusts an event once seq matches its own position. Any
+ *  number of consumers, open files or processes that mmap-ed the ring, each keep their own position
+ *  and the producers never look at them: the oldest slot is simply reused, and a consumer that
+ *  finds a slot seq ahead of its position knows it was overrun. Positions are free-running u32
+ *  counters, only the low bits select the slot. The control page and the slots are one vmalloc
+ *  area so both can be mapped. */
+static struct {
+   struct ebbgpio_ring_ctrl *ctrl;   ///< First page of the area: head, overrun count and layout
+   struct ebbgpio_slot *slots;       ///< The slots, starting on the page after the control page
+   u32 mask;                         ///< Number of slots - 1
+} eventRing;
+
+/** @brief The read() consumer of one open /dev/ebbgpio file */
+struct ebbgpio_reader {
+   struct mutex lock;                ///< Serialises the readers sharing the file
+   u32 pos;                          ///< Ring position of the next event of this file
+   u32 lost;                         ///< Events overrun since the last OVERRUN record, 0 if none
+};
+
+/** The generic netlink family. It is one more consumer of the ring: the first event queued while
+ *  anyone listens schedules genlWork netlinkMs later, and the work sends everything queued by then
+ *  in as few messages as it takes, with up to EBBGPIO_GENL_BATCH events each. The multicast copies
+ *  the message to each listener, so the IRQ path does the same work for one listener or ten. */
+#define EBBGPIO_GENL_BATCH 64
+static struct ebbgpio_reader genlReader;
+static struct ebbgpio_event genlBatch[EBBGPIO_GENL_BATCH];   ///< The batch being built, under genlReader.lock
+static bool genlReady;               ///< The family is registered, events may schedule genlWork
+/// An event was queued while nobody listened. The first event queued after someone joins clears it
+/// and leaves its position in genlStart, where the work restarts the stream, so a new listener is not
+/// sent whatever was left in the ring since the last one left.
+static bool genlIdle;
+static bool genlRestart;             ///< genlStart is set and the work has not moved there yet
+static u32 genlStart;                ///< Ring position of the first event queued for the new listeners
+static void ebbgpio_genl_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(genlWork, ebbgpio_genl_work);
+static struct genl_family ebbgpio_genl_family;
+static DECLARE_WAIT_QUEUE_HEAD(eventWait);  ///< Readers sleep here until an event is queued
+/// Interrupt moderation for the readers: the events are counted as they are queued, and the sleeping
+/// readers are only woken once coalesceEvents are pending or coalesceTimer ends coalesceUs after the
+/// first of them, so a burst costs one wakeup and the reader takes it with one read().
+static atomic_t coalescePending;     ///< Events queued since the readers were last woken
+static struct hrtimer coalesceTimer; ///< Wakes the readers for the events that did not make a batch
+static struct fasync_struct *eventAsync;    ///< Processes that asked for SIGIO with O_ASYNC
+static void ebbgpio_wake_work(struct work_struct *work);
+static DECLARE_WORK(wakeWork, ebbgpio_wake_work);  ///< Wakes the readers for the atomic callers on RT
+
+/** The bench=1 harness. Every button is a line of an irq_sim domain instead of a GPIO, and a kthread
+ *  injects benchEdges edges round-robin over the buttons at benchRate edges per second by setting the
+ *  simulated line level and marking its IRQ pending. The simulator delivers the IRQ from irq_work, so
+ *  the whole pipeline after the GPIO runs as usual: top half, storm check, debouncing, gestures, rules,
+ *  LEDs (logical state only), the event ring, the IRQ thread and the script dispatch. An edge injected
+ *  while the previous one of the same line is still pending is merged by the simulator, that shows up
+ *  as injected - handled. The results are in <debugfs>/ebbgpio/bench and in the log once the run ends. */
+static struct {
+   struct task_struct *task;         ///< The injector
+   ktime_t start;                    ///< When the injection started
+   ktime_t elapsed;                  ///< How long the injection took, 0 while running
+   u64 injected;                     ///< Edges injected so far
+   u32 dropped;                      ///< Ring overrun count when the run started
+} benchRun;
+static DEFINE_PER_CPU(unsigned long, benchHandled);  ///< Edges that reached the top half
+
+/// The phases of benchStress=1, run one after the other with benchEdges / 4 edges each
+enum { EBBGPIO_STRESS_BOUNCE, EBBGPIO_STRESS_STUCK, EBBGPIO_STRESS_ALL, EBBGPIO_STRESS_STALL, EBBGPIO_STRESS_PHASES };
+static const char *const ebbgpio_stress_names[] = {"bounce", "stuck", "all_cpus", "stalled_reader"};
+/// The memory in kB a stress run may leave less of. Others use the memory too, so it is not 0, but a
+/// leak of a few bytes per edge or per event is well past it.
+#define EBBGPIO_STRESS_MEM_KB 4096
+
+/** The benchStress=1 harness, on the simulated lines of bench=1. Each phase is a worst case: bursts
+ *  of edges on one button (the storm detector), button A held while the others are used (the long
+ *  press and repeat timers), every button from a kthread on every CPU at once, and a consumer that
+ *  stops reading. While the injectors run the harness checks every 100 ms that something moves and
+ *  samples the pending script runs; at the end it checks the counters against each other. The
+ *  report is in <debugfs>/ebbgpio/stress and in the log once the run ends. */
+static struct {
+   unsigned int phase;               ///< The phase running, EBBGPIO_STRESS_PHASES once all are done
+   u64 injected[EBBGPIO_STRESS_PHASES];  ///< Edges injected by each phase
+   unsigned int stalls[EBBGPIO_STRESS_PHASES];   ///< Seconds in which nothing moved, should be 0
+   unsigned int storms;              ///< Storms detected over the run
+   unsigned int bounceStorms;        ///< Storms detected in the bounce phase, which must trigger one
+   int maxPending;                   ///< Most script runs pending on one button at any check
+   u32 stallQueued;                  ///< Events queued while the stalled reader did not read
+   u32 stallKept;                    ///< Events it still found afterwards, at most a ring
+   u32 stallLost;                    ///< Events it was told it lost
+   long memDelta;                    ///< Change of the available memory over the run in kB
+   unsigned int failures;            ///< Checks that failed, 0 is a clean run
+} stressRun;
+
+static int ebbgpio_dev_register(void);
+static void ebbgpio_dev_deregister(void *unused);
+static int ebbgpio_genl_register(void);
+static void ebbgpio_genl_unregister(void *unused);
+static int ebbgpio_button_up(struct device *dev, struct ebbgpio_button *b);
+static void ebbgpio_button_down(struct ebbgpio_button *b);
+static u64 ebbgpio_presses(struct ebbgpio_button *b);
+static void ebbgpio_debugfs_init(void);
+static int ebbgpio_bench_init(void);
+static void ebbgpio_bench_start(void);
+static void ebbgpio_bench_stop(void *unused);
+static void ebbgpio_bench_exit(void *unused);
+static int ebbgpio_bench_irq(struct ebbgpio_button *b);
+static void ebbgpio_dispatch_work(struct work_struct *work);
+static void ebbgpio_dispatch(struct ebbgpio_button *b);
+static void ebbgpio_wake_thread(struct ebbgpio_button *b);
+static int ebbgpio_irq_affinity(struct ebbgpio_button *b);
+static enum hrtimer_restart ebbgpio_poll_timer(struct hrtimer *timer);
+static enum hrtimer_restart ebbgpio_coalesce_timer(struct hrtimer *timer);
+static int ebbgpio_rules_init(void);
+static void ebbgpio_rules_free(void *unused);
+static enum hrtimer_restart ebbgpio_pulse_timer(struct hrtimer *timer);
+static struct class_attribute class_attr_rules;
+static struct class_attribute class_attr_stats;
+static void ebbgpio_leds_update(unsigned long set, unsigned long clear, unsigned long toggle);
+static void ebbgpio_leds_rewrite(void);
 
 /// Function prototype for the custom IRQ handler function -- see below for the implementation
-static irq_handler_t  ebbgpio_irq_handlerA(unsigned int irq, void *dev_id, struct pt_regs *regs);
-static irq_handler_t  ebbgpio_irq_handlerB(unsigned int irq, void *dev_id, struct pt_regs *regs);
-static irq_handler_t  ebbgpio_irq_handlerC(unsigned int irq, void *dev_id, struct pt_regs *regs);
-static irq_handler_t  ebbgpio_irq_handlerD(unsigned int irq, void *dev_id, struct pt_regs *regs);
+static irq_handler_t  ebbgpio_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs);
+/// The threaded bottom half -- it runs in process context when threaded=1
+static irq_handler_t  ebbgpio_irq_thread(unsigned int irq, void *dev_id, struct pt_regs *regs);
+static bool ebbgpio_wake_edge(struct ebbgpio_button *b, ktime_t time, unsigned long held);
+static unsigned int ebbgpio_key(unsigned int i);
+int ebbgpio_filter_event(unsigned int button, unsigned int edge, u64 timestamp, u32 duration, u32 seq);
+static void ebbgpio_count(struct ebbgpio_button *b, int counter);
  
+/** @brief Clear the instance pointer when the device goes away
+ *  @param unused devm action argument, not used
+ */
+static void ebbgpio_unbind(void *unused){
+   WRITE_ONCE(ebbgpioDev, NULL);
+}
+
+/** @brief devm action of the dispatch workqueue, the buttons have already flushed their scripts */
+static void ebbgpio_wq_destroy(void *wq){
+   destroy_workqueue(wq);
+}
+
+/** @brief devm action of /sys/class/ebbgpio */
+static void ebbgpio_class_destroy(void *unused){
+   class_remove_file(ebbgpioClass, &class_attr_stats);
+   class_remove_file(ebbgpioClass, &class_attr_rules);
+   class_destroy(ebbgpioClass);
+}
+
+/** @brief devm action of <debugfs>/ebbgpio */
+static void ebbgpio_debugfs_remove(void *unused){
+   debugfs_remove_recursive(ebbgpioDebugfs);
+}
+
+/** @brief Get one GPIO, from the device tree node or from its number
+ *  The module drives the lines with the raw values, so any GPIO_ACTIVE_LOW flag in the device tree
+ *  is ignored, the same as with gpio_set_value().
+ *  @param dev   the ebbgpio device
+ *  @param con   "led" or "button", the <con>-gpios property of the node
+ *  @param index index of the line in the property
+ *  @param gpio  the GPIO number, used if the line is not from the node
+ *  @param fw    the line is from the device tree node
+ *  @param flags GPIOD_IN, GPIOD_OUT_LOW or GPIOD_OUT_HIGH
+ *  @return returns the descriptor or an ERR_PTR
+ */
+static struct gpio_desc *ebbgpio_gpio_get(struct device *dev, const char *con, unsigned int index,
+                                          unsigned int gpio, bool fw, enum gpiod_flags flags){
+   int result;
+   if (fw) return gpiod_get_index(dev, con, index, flags);
+   result = gpio_request_one(gpio, flags == GPIOD_IN ? GPIOF_IN :
+                             flags == GPIOD_OUT_HIGH ? GPIOF_OUT_INIT_HIGH : GPIOF_OUT_INIT_LOW, "sysfs");
+   return result ? ERR_PTR(result) : gpio_to_desc(gpio);
+}
+
+/** @brief Release a GPIO from ebbgpio_gpio_get()
+ *  @param desc the descriptor
+ *  @param fw   the line is from the device tree node
+ */
+static void ebbgpio_gpio_put(struct gpio_desc *desc, bool fw){
+   if (fw) gpiod_put(desc);
+   else gpio_free(desc_to_gpio(desc));
+}
+
+/// The GPIO controllers whose set and clear registers mmioLeds=1 knows, all laid out like the BCM2835
+static const struct of_device_id ebbgpio_mmio_ids[] = {
+   { .compatible = "brcm,bcm2835-gpio" },
+   { .compatible = "brcm,bcm2711-gpio" },
+   { .compatible = "brcm,bcm7211-gpio" },
+   { }
+};
+
+/** @brief Check whether an LED can be written straight to the registers of its controller. The
+ *  controller must be in ebbgpio_mmio_ids and its register block big enough; the first one found
+ *  is mapped (the pinctrl driver owns the region, so it is not requested again) and the LEDs of any
+ *  other controller stay on gpiolib. Called under configLock.
+ *  @param desc the descriptor of the LED, already an output
+ *  @param hw   where the line of the LED on its controller is returned
+ *  @return returns true if the LED can take the fast path
+ */
+static bool ebbgpio_led_mmio(struct gpio_desc *desc, u8 *hw){
+   struct gpio_chip *chip = gpiod_to_chip(desc);
+   struct device_node *np = chip && chip->parent ? chip->parent->of_node : NULL;
+   struct resource res;
+   int line;
+   if (!mmioLeds || !np || !of_match_node(ebbgpio_mmio_ids, np)) return false;
+   line = desc_to_gpio(desc) - chip->base;
+   if (line < 0 || line >= BCM2835_NGPIO) return false;
+   if (!ledRegs){
+      if (of_address_to_resource(np, 0, &res) || resource_size(&res) < BCM2835_GPCLR0 + 8) return false;
+      ledRegs = ioremap(res.start, resource_size(&res));
+      if (!ledRegs) return false;
+      ledRegsNode = np;
+      printk(KERN_INFO "GPIO_TEST: The LEDs on %pOF are written through its registers\n", np);
+   }
+   if (np != ledRegsNode) return false;
+   *hw = line;
+   return true;
+}
+
+/** @brief Bring up one LED and add it to the array writes. Called under configLock.
+ *  @param dev the ebbgpio device
+ *  @param i   the index of the LED
+ *  @param on  the initial state of the LED
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_led_up(struct device *dev, unsigned int i, bool on){
+   struct gpio_desc *desc = NULL;
+   unsigned long flags;
+   bool fast = false;
+   u8 hw = 0;
+   if (test_bit(i, &ledMask)) return 0;
+   if (!bench){                              // The benchmark only keeps the logical LED state
+      desc = ebbgpio_gpio_get(dev, "led", i, ledGpios[i], test_bit(i, &ledFw), on ? GPIOD_OUT_HIGH : GPIOD_OUT_LOW);
+      if (IS_ERR(desc)) return PTR_ERR(desc);
+      gpiod_direction_output_raw(desc, on);  // Set the gpio to be in output mode
+      gpiod_export(desc, false);             // Causes gpioN to appear in /sys/class/gpio
+                                             // the bool argument prevents the direction from being changed
+      fast = ebbgpio_led_mmio(desc, &hw);
+   }
+   if (i >= numLeds) numLeds = i + 1;        // The rules may name it from now on
+   raw_spin_lock_irqsave(&ledLock, flags);
+   ledDescs[i] = desc;
+   ledHw[i] = hw;
+   if (fast) __set_bit(i, &ledFast);
+   else __clear_bit(i, &ledFast);
+   if (on) set_bit(i, &ledOn);
+   else clear_bit(i, &ledOn);
+   ledWritten = (ledWritten & ~BIT(i)) | (on ? BIT(i) : 0);   // That is what the line was set to
+   WRITE_ONCE(ledMask, ledMask | BIT(i));
+   raw_spin_unlock_irqrestore(&ledLock, flags);
+   return 0;
+}
+
+/** @brief Turn one LED off and release it, the other LEDs keep running. Called under configLock.
+ *  @param i the index of the LED
+ */
+static void ebbgpio_led_down(unsigned int i){
+   struct gpio_desc *desc;
+   unsigned long flags;
+   if (!test_bit(i, &ledMask)) return;
+   hrtimer_cancel(&ledPulse[i]);
+   ebbgpio_leds_update(0, BIT(i), 0);        // Off before the line is released
+   raw_spin_lock_irqsave(&ledLock, flags);
+   WRITE_ONCE(ledMask, ledMask & ~BIT(i));   // No more writes of it
+   __clear_bit(i, &ledFast);
+   desc = ledDescs[i];
+   ledDescs[i] = NULL;
+   raw_spin_unlock_irqrestore(&ledLock, flags);
+   if (!desc) return;
+   gpiod_unexport(desc);                     // Unexport the LED GPIO
+   ebbgpio_gpio_put(desc, test_bit(i, &ledFw));
+}
+
+/** @brief devm action of the LEDs, makes it clear the device was unloaded
+ *  @param unused devm action argument, not used
+ */
+static void ebbgpio_leds_down(void *unused){
+   int i;
+   for (i = 0; i < EBBGPIO_MAX_LEDS; i++) hrtimer_cancel(&ledPulse[i]);   // No pulse may turn an LED back on
+   ebbgpio_leds_update(0, ~0UL, 0);          // All the LEDs off in one write
+   mutex_lock(&configLock);
+   for (i = 0; i < EBBGPIO_MAX_LEDS; i++) ebbgpio_led_down(i);
+   if (ledRegs) iounmap(ledRegs);            // No LED is left to write through it
+   ledRegs = NULL;
+   ledRegsNode = NULL;
+   mutex_unlock(&configLock);
+}
+
+/** @brief devm action of the input device, it is unregistered by devm right after this. The
+ *  buttons are already down, so nothing queues key edges any more.
+ */
+static void ebbgpio_input_clear(void *unused){
+   WRITE_ONCE(ebbgpioInput, NULL);
+   cancel_work_sync(&inputWork);             // A report in progress still uses the device
+   inputTail = inputHead;                    // The next device does not get the leftovers
+   inputOverflow = false;
+}
+
+/** @brief Register the input device of inputDev=1, devm-managed
+ *  Every key a button can have is declared, so buttons added later through configfs report too.
+ *  @param dev the ebbgpio device
+ *  @return returns 0 if successful or if inputDev=0
+ */
+static int ebbgpio_input_register(struct device *dev){
+   struct input_dev *input;
+   int result, i;
+   if (!inputDev) return 0;
+   input = devm_input_allocate_device(dev);
+   if (!input) return -ENOMEM;
+   input->name = "ebbgpio buttons";
+   input->phys = "ebbgpio/input0";
+   input->id.bustype = BUS_HOST;
+   for (i = 0; i < EBBGPIO_MAX_BUTTONS; i++){
+      if (ebbgpio_key(i) > KEY_MAX) return -EINVAL;
+      input_set_capability(input, EV_KEY, ebbgpio_key(i));
+   }
+   result = input_register_device(input);
+   if (result){
+      dev_err(dev, "failed to register the input device: %d\n", result);
+      return result;
+   }
+   ebbgpioInput = input;
+   return devm_add_action_or_reset(dev, ebbgpio_input_clear, NULL);
+}
+
+/** @brief devm action of the wake-up capability of the device */
+static void ebbgpio_wakeup_disable(void *dev){
+   device_init_wakeup(dev, false);
+}
+
+/** @brief devm action of the buttons, the first thing undone after the benchmark
+ *  @param unused devm action argument, not used
+ */
+static void ebbgpio_buttons_down(void *unused){
+   int i;
+   mutex_lock(&configLock);
+   ebbgpioReady = false;                     // configfs can not bring anything up any more
+   for (i = 0; i < EBBGPIO_MAX_BUTTONS; i++) ebbgpio_button_down(&buttons[i]);
+   mutex_unlock(&configLock);
+}
+
+/** @brief Size the LED and button tables from the device tree node of the device, if it has one
+ *  Without a node, the leds= and buttons= parameters are used as they are.
+ *  @param dev the ebbgpio device
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_count_gpios(struct device *dev){
+   int count;
+   if (!dev_fwnode(dev)) return 0;
+   count = gpiod_count(dev, "led");
+   numLeds = count < 0 ? 0 : count;         // The LEDs are optional
+   count = gpiod_count(dev, "button");
+   if (count <= 0) return -ENODEV;
+   numButtons = count;
+   if (numLeds > EBBGPIO_MAX_LEDS || numButtons > EBBGPIO_MAX_BUTTONS) return -EINVAL;
+   return 0;
+}
+
+/** @brief Bring up the LEDs and the buttons of the ebbgpio device
+ *  Everything is acquired in one pass, and every step is paired with a devm action that undoes it. A
+ *  failure at any point, or the removal of the device, releases exactly what was acquired so far in
+ *  the reverse order, so a half-failed probe leaves no GPIO or IRQ behind and can simply be retried.
+ *  The driver prefers asynchronous probing, so loading the module does not wait for all of this.
+ *  @param pdev the platform device, from the device tree or created by ebbgpio_init()
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_probe(struct platform_device *pdev){
+   struct device *dev = &pdev->dev;
+   int result;
+   int i;
+   if (cmpxchg(&ebbgpioDev, NULL, dev)) return -EBUSY;   // The state is global, one device at a time
+   result = devm_add_action_or_reset(dev, ebbgpio_unbind, NULL);
+   if (result) return result;
+   for (i = 0; i < EBBGPIO_MAX_BUTTONS; i++){   // Nothing left from a previous bind but the configfs items
+      struct ebbgpio_cfg *cfg = buttons[i].cfg;
+      memset(&buttons[i], 0, sizeof(buttons[i]));
+      buttons[i].index = i;
+      buttons[i].cfg = cfg;
+   }
+   memset(&benchRun, 0, sizeof(benchRun));
+   if (threaded && (irqPriority < 1 || irqPriority > MAX_RT_PRIO - 1)){
+      dev_err(dev, "invalid IRQ thread priority %d\n", irqPriority);
+      return -EINVAL;
+   }
+   result = ebbgpio_count_gpios(dev);
+   if (result){
+      dev_err(dev, "invalid led-gpios or button-gpios\n");
+      return result;
+   }
+   ledFw = dev_fwnode(dev) && numLeds ? GENMASK(numLeds - 1, 0) : 0;
+   for (i = 0; i < numButtons; i++) buttons[i].fw = dev_fwnode(dev);
+   // Is the GPIO a valid GPIO number (e.g., the BBB has 4x32 but not all available)
+   for (i = 0; i < numLeds; i++){
+      if (!bench && !dev_fwnode(dev) && !gpio_is_valid(ledGpios[i])){
+         dev_err(dev, "invalid LED %d GPIO\n", i);
+         return -ENODEV;
+      }
+   }
+   for (i = 0; i < numButtons; i++){
+      if ((!bench && !dev_fwnode(dev) && !gpio_is_valid(buttonGpios[i])) || buttonLeds[i] >= numLeds){
+         dev_err(dev, "invalid button %c GPIO or LED\n", 'A' + i);
+         return -ENODEV;
+      }
+   }
+   if (!strcmp(clockName, "boottime")) useBoottime = true;
+   else if (!strcmp(clockName, "monotonic")) useBoottime = false;
+   else {
+      dev_err(dev, "invalid clock %s\n", clockName);
+      return -EINVAL;
+   }
+   dispatchPolicy = match_string(ebbgpio_policy_names, ARRAY_SIZE(ebbgpio_policy_names), scriptPolicy);
+   if (dispatchPolicy < 0 || maxScripts < 1 || maxScripts > WQ_MAX_ACTIVE || scriptDepth < 1){
+      dev_err(dev, "invalid script dispatch settings\n");
+      return -EINVAL;
+   }
+   result = ebbgpio_bench_init();            // The simulated IRQs of bench=1, nothing otherwise
+   if (!result) result = devm_add_action_or_reset(dev, ebbgpio_bench_exit, NULL);
+   if (result) return result;
+   result = ebbgpio_rules_init();            // The default rules, from buttonLed and buttonAction
+   if (!result) result = devm_add_action_or_reset(dev, ebbgpio_rules_free, NULL);
+   if (result) return result;
+   // The scripts run from an unbound workqueue, max_active caps how many run at the same time
+   // WQ_SYSFS: the CPUs of its workers are set in /sys/devices/virtual/workqueue/ebbgpio_dispatch
+   dispatchWq = alloc_workqueue("ebbgpio_dispatch", WQ_UNBOUND | WQ_SYSFS, maxScripts);
+   if (!dispatchWq) return -ENOMEM;
+   result = devm_add_action_or_reset(dev, ebbgpio_wq_destroy, dispatchWq);
+   if (result) return result;
+   result = ebbgpio_dev_register();          // Create /dev/ebbgpio before any event can be produced
+   if (!result) result = devm_add_action_or_reset(dev, ebbgpio_dev_deregister, NULL);
+   if (result) return result;
+   result = ebbgpio_genl_register();         // Another consumer of the ring, so after it
+   if (!result) result = devm_add_action_or_reset(dev, ebbgpio_genl_unregister, NULL);
+   if (result) return result;
+   ebbgpioClass = class_create(THIS_MODULE, "ebbgpio");
+   if (IS_ERR(ebbgpioClass)) return PTR_ERR(ebbgpioClass);
+   result = class_create_file(ebbgpioClass, &class_attr_rules);
+   if (!result){
+      result = class_create_file(ebbgpioClass, &class_attr_stats);
+      if (result) class_remove_file(ebbgpioClass, &class_attr_rules);
+   }
+   if (result){
+      class_destroy(ebbgpioClass);
+      return result;
+   }
+   result = devm_add_action_or_reset(dev, ebbgpio_class_destroy, NULL);
+   if (result) return result;
+   ebbgpio_debugfs_init();                   // Optional, so a failure here is not fatal
+   result = devm_add_action_or_reset(dev, ebbgpio_debugfs_remove, NULL);
+   if (result) return result;
+   BUILD_BUG_ON(EBBGPIO_MAX_LEDS > BITS_PER_LONG);   // ledOn is a single word
+   ledMask = ledOn = ledWritten = 0;
+   for (i = 0; i < EBBGPIO_MAX_LEDS; i++){
+      hrtimer_init(&ledPulse[i], CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+      ledPulse[i].function = ebbgpio_pulse_timer;
+   }
+   hrtimer_init(&pollTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+   pollTimer.function = ebbgpio_poll_timer;
+   result = ebbgpio_input_register(dev);
+   if (result) return result;
+   device_init_wakeup(dev, true);            // The buttons wake the system, see power/wakeup
+   result = devm_add_action_or_reset(dev, ebbgpio_wakeup_disable, dev);
+   if (!result) result = devm_add_action_or_reset(dev, ebbgpio_leds_down, NULL);   // After the buttons are gone
+   if (!result) result = devm_add_action_or_reset(dev, ebbgpio_buttons_down, NULL);
+   if (result) return result;
+   mutex_lock(&configLock);
+   // Going to set up the LEDs. They are GPIOs in output mode and will be on by default
+   for (i = 0; i < numLeds && !result; i++){
+      result = ebbgpio_led_up(dev, i, true);
+      if (result) dev_err(dev, "failed to get LED %d: %d\n", i, result);
+   }
+   for (i = 0; i < numButtons && !result; i++){
+      result = ebbgpio_button_up(dev, &buttons[i]);
+      if (result) dev_err(dev, "failed to set up button %c: %d\n", 'A' + i, result);
+   }
+   ebbgpioReady = !result;
+   mutex_unlock(&configLock);
+   if (result) return result;
+   ebbgpio_bench_start();                    // Everything is up, start injecting edges
+   result = devm_add_action_or_reset(dev, ebbgpio_bench_stop, NULL);   // The first thing undone
+   if (result) return result;
+   dev_info(dev, "%d buttons and %d LEDs are up\n", numButtons, numLeds);
+   return 0;
+}
+
+/** @brief Nothing to do, the devm actions of ebbgpio_probe() undo everything in reverse order */
+static int ebbgpio_remove(struct platform_device *pdev){
+   return 0;
+}
+
+/** The configfs tree, /sys/kernel/config/ebbgpio/{buttons,leds}. mkdir buttons/C or leds/2 adopts
+ *  that slot, whether the table already brought it up or not, and rmdir takes it down. Each item
+ *  has an enable attribute that brings the slot up or down, and writing any other attribute of a
+ *  slot that is up rebinds it: only that slot is taken down and brought up again with the new
+ *  setting, its counters are kept and all the other buttons and LEDs keep running. Buttons added
+ *  this way start without rules, add them through /sys/class/ebbgpio/rules. */
+static inline struct ebbgpio_cfg *to_ebbgpio_cfg(struct config_item *item){
+   return container_of(item, struct ebbgpio_cfg, item);
+}
+
+/** @brief Bring a button or an LED up or down, or take it down and up again. Called under configLock.
+ *  @param cfg    the configfs item of the slot
+ *  @param button the slot is a button, else an LED
+ *  @param up     bring the slot up, else down
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_cfg_apply(struct ebbgpio_cfg *cfg, bool button, bool up){
+   int result = 0;
+   if (!ebbgpioReady) return up ? -ENODEV : 0;   // Nothing is running without a bound device
+   if (bench) return -EBUSY;                 // The injector owns the buttons
+   if (button){
+      ebbgpio_button_down(&buttons[cfg->index]);
+      if (up) result = ebbgpio_button_up(ebbgpioDev, &buttons[cfg->index]);
+   }
+   else {
+      bool on = test_bit(cfg->index, &ledOn);   // A rebound LED keeps its state
+      ebbgpio_led_down(cfg->index);
+      if (up) result = ebbgpio_led_up(ebbgpioDev, cfg->index, on);
+   }
+   return result;
+}
+
+/** @brief Store a GPIO number for a slot and rebind the slot if it is up
+ *  @param cfg    the configfs item of the slot
+ *  @param button the slot is a button, else an LED
+ *  @param gpio   where the GPIO number of the slot is kept
+ *  @param page   the text written
+ *  @param count  its length
+ *  @return returns count if successful
+ */
+static ssize_t ebbgpio_cfg_gpio_store(struct ebbgpio_cfg *cfg, bool button, unsigned int *gpio,
+                                      const char *page, size_t count){
+   unsigned int value;
+   bool up, on;
+   int result = kstrtouint(page, 0, &value);
+   if (result) return result;
+   if (!gpio_is_valid(value)) return -EINVAL;
+   mutex_lock(&configLock);
+   up = button ? buttons[cfg->index].up : test_bit(cfg->index, &ledMask);
+   on = !button && test_bit(cfg->index, &ledOn);   // Before the down turns the LED off
+   if (up) result = ebbgpio_cfg_apply(cfg, button, false);   // Down before the slot forgets its old GPIO
+   if (result){
+      mutex_unlock(&configLock);
+      return result;
+   }
+   *gpio = value;
+   if (button) buttons[cfg->index].fw = false;
+   else clear_bit(cfg->index, &ledFw);
+   if (up && button) result = ebbgpio_cfg_apply(cfg, true, true);
+   else if (up) result = ebbgpio_led_up(ebbgpioDev, cfg->index, on);   // The LED keeps its state on the new GPIO
+   mutex_unlock(&configLock);
+   return result ? result : count;
+}
+
+static ssize_t ebbgpio_button_gpio_show(struct config_item *item, char *page){
+   return sprintf(page, "%u\n", buttonGpios[to_ebbgpio_cfg(item)->index]);
+}
+
+static ssize_t ebbgpio_button_gpio_store(struct config_item *item, const char *page, size_t count){
+   struct ebbgpio_cfg *cfg = to_ebbgpio_cfg(item);
+   return ebbgpio_cfg_gpio_store(cfg, true, &buttonGpios[cfg->index], page, count);
+}
+
+static ssize_t ebbgpio_button_script_show(struct config_item *item, char *page){
+   return sprintf(page, "%s\n", to_ebbgpio_cfg(item)->script);
+}
+
+static ssize_t ebbgpio_button_script_store(struct config_item *item, const char *page, size_t count){
+   struct ebbgpio_cfg *cfg = to_ebbgpio_cfg(item);
+   struct ebbgpio_button *b = &buttons[cfg->index];
+   int result = 0;
+   if (count >= sizeof(cfg->script)) return -ENAMETOOLONG;
+   mutex_lock(&configLock);
+   strscpy(cfg->script, page, sizeof(cfg->script));
+   strim(cfg->script);                       // The trailing newline of echo
+   if (b->up) result = ebbgpio_cfg_apply(cfg, true, true);   // The script path is taken at bring up
+   mutex_unlock(&configLock);
+   return result ? result : count;
+}
+
+static ssize_t ebbgpio_button_debounce_us_show(struct config_item *item, char *page){
+   return sprintf(page, "%u\n", debounceUs[to_ebbgpio_cfg(item)->index]);
+}
+
+static ssize_t ebbgpio_button_debounce_us_store(struct config_item *item, const char *page, size_t count){
+   struct ebbgpio_cfg *cfg = to_ebbgpio_cfg(item);
+   unsigned int value;
+   int result = kstrtouint(page, 0, &value);
+   if (result) return result;
+   mutex_lock(&configLock);
+   debounceUs[cfg->index] = value;
+   if (buttons[cfg->index].up) result = ebbgpio_cfg_apply(cfg, true, true);
+   mutex_unlock(&configLock);
+   return result ? result : count;
+}
+
+static ssize_t ebbgpio_button_enable_show(struct config_item *item, char *page){
+   return sprintf(page, "%d\n", READ_ONCE(buttons[to_ebbgpio_cfg(item)->index].up));
+}
+
+static ssize_t ebbgpio_button_enable_store(struct config_item *item, const char *page, size_t count){
+   struct ebbgpio_cfg *cfg = to_ebbgpio_cfg(item);
+   bool enable;
+   int result = kstrtobool(page, &enable);
+   if (result) return result;
+   mutex_lock(&configLock);
+   if (enable != buttons[cfg->index].up) result = ebbgpio_cfg_apply(cfg, true, enable);
+   mutex_unlock(&configLock);
+   return result ? result : count;
+}
+
+CONFIGFS_ATTR(ebbgpio_button_, gpio);
+CONFIGFS_ATTR(ebbgpio_button_, script);
+CONFIGFS_ATTR(ebbgpio_button_, debounce_us);
+CONFIGFS_ATTR(ebbgpio_button_, enable);
+
+static struct configfs_attribute *ebbgpio_button_cfg_attrs[] = {
+   &ebbgpio_button_attr_gpio,
+   &ebbgpio_button_attr_script,
+   &ebbgpio_button_attr_debounce_us,
+   &ebbgpio_button_attr_enable,
+   NULL,
+};
+
+static ssize_t ebbgpio_led_gpio_show(struct config_item *item, char *page){
+   return sprintf(page, "%u\n", ledGpios[to_ebbgpio_cfg(item)->index]);
+}
+
+static ssize_t ebbgpio_led_gpio_store(struct config_item *item, const char *page, size_t count){
+   struct ebbgpio_cfg *cfg = to_ebbgpio_cfg(item);
+   return ebbgpio_cfg_gpio_store(cfg, false, &ledGpios[cfg->index], page, count);
+}
+
+static ssize_t ebbgpio_led_enable_show(struct config_item *item, char *page){
+   return sprintf(page, "%d\n", test_bit(to_ebbgpio_cfg(item)->index, &ledMask));
+}
+
+static ssize_t ebbgpio_led_enable_store(struct config_item *item, const char *page, size_t count){
+   struct ebbgpio_cfg *cfg = to_ebbgpio_cfg(item);
+   bool enable;
+   int result = kstrtobool(page, &enable);
+   if (result) return result;
+   mutex_lock(&configLock);
+   if (enable != test_bit(cfg->index, &ledMask)) result = ebbgpio_cfg_apply(cfg, false, enable);
+   mutex_unlock(&configLock);
+   return result ? result : count;
+}
+
+CONFIGFS_ATTR(ebbgpio_led_, gpio);
+CONFIGFS_ATTR(ebbgpio_led_, enable);
+
+static struct configfs_attribute *ebbgpio_led_cfg_attrs[] = {
+   &ebbgpio_led_attr_gpio,
+   &ebbgpio_led_attr_enable,
+   NULL,
+};
+
+static void ebbgpio_cfg_release(struct config_item *item){
+   kfree(to_ebbgpio_cfg(item));
+}
+
+static struct configfs_item_operations ebbgpio_cfg_item_ops = {
+   .release = ebbgpio_cfg_release,
+};
+
+static const struct config_item_type ebbgpio_button_type = {
+   .ct_item_ops = &ebbgpio_cfg_item_ops,
+   .ct_attrs    = ebbgpio_button_cfg_attrs,
+   .ct_owner    = THIS_MODULE,
+};
+
+static const struct config_item_type ebbgpio_led_type = {
+   .ct_item_ops = &ebbgpio_cfg_item_ops,
+   .ct_attrs    = ebbgpio_led_cfg_attrs,
+   .ct_owner    = THIS_MODULE,
+};
+
+/** @brief mkdir buttons/X or leds/N: adopt the slot
+ *  @param group the buttons or the leds group
+ *  @param name  the letter of the button or the number of the LED
+ *  @return returns the new item or an ERR_PTR
+ */
+static struct config_item *ebbgpio_cfg_make(struct config_group *group, const char *name){
+   bool button = !strcmp(config_item_name(&group->cg_item), "buttons");
+   struct ebbgpio_cfg *cfg;
+   unsigned int index;
+   char canonical[4];
+   if (button){
+      if (strlen(name) != 1 || name[0] < 'A' || name[0] >= 'A' + EBBGPIO_MAX_BUTTONS) return ERR_PTR(-EINVAL);
+      index = name[0] - 'A';
+   }
+   else {                                    // One name per LED, so "02" is not a second leds/2
+      if (kstrtouint(name, 10, &index) || index >= EBBGPIO_MAX_LEDS) return ERR_PTR(-EINVAL);
+      snprintf(canonical, sizeof(canonical), "%u", index);
+      if (strcmp(name, canonical)) return ERR_PTR(-EINVAL);
+   }
+   cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+   if (!cfg) return ERR_PTR(-ENOMEM);
+   cfg->index = index;
+   config_item_init_type_name(&cfg->item, name, button ? &ebbgpio_button_type : &ebbgpio_led_type);
+   if (button){
+      mutex_lock(&configLock);
+      buttons[index].cfg = cfg;
+      mutex_unlock(&configLock);
+   }
+   return &cfg->item;
+}
+
+/** @brief rmdir buttons/X or leds/N: take the slot down
+ *  @param group the buttons or the leds group
+ *  @param item  the item of the slot
+ */
+static void ebbgpio_cfg_drop(struct config_group *group, struct config_item *item){
+   struct ebbgpio_cfg *cfg = to_ebbgpio_cfg(item);
+   bool button = item->ci_type == &ebbgpio_button_type;
+   mutex_lock(&configLock);
+   ebbgpio_cfg_apply(cfg, button, false);
+   if (button) buttons[cfg->index].cfg = NULL;
+   mutex_unlock(&configLock);
+   config_item_put(item);
+}
+
+static struct configfs_group_operations ebbgpio_cfg_group_ops = {
+   .make_item = ebbgpio_cfg_make,
+   .drop_item = ebbgpio_cfg_drop,
+};
+
+static const struct config_item_type ebbgpio_slots_type = {
+   .ct_group_ops = &ebbgpio_cfg_group_ops,
+   .ct_owner     = THIS_MODULE,
+};
+
+static const struct config_item_type ebbgpio_root_type = {
+   .ct_owner = THIS_MODULE,
+};
+
+static struct config_group ebbgpioButtonsGroup, ebbgpioLedsGroup;
+static struct configfs_subsystem ebbgpioSubsys = {
+   .su_group = {
+      .cg_item = {
+         .ci_namebuf = "ebbgpio",
+         .ci_type    = &ebbgpio_root_type,
+      },
+   },
+};
+
+/** @brief Register /sys/kernel/config/ebbgpio. Its items pin the module, so it stays registered as
+ *  long as the module is loaded, and only does anything while a device is bound.
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_configfs_register(void){
+   config_group_init(&ebbgpioSubsys.su_group);
+   mutex_init(&ebbgpioSubsys.su_mutex);
+   config_group_init_type_name(&ebbgpioButtonsGroup, "buttons", &ebbgpio_slots_type);
+   configfs_add_default_group(&ebbgpioButtonsGroup, &ebbgpioSubsys.su_group);
+   config_group_init_type_name(&ebbgpioLedsGroup, "leds", &ebbgpio_slots_type);
+   configfs_add_default_group(&ebbgpioLedsGroup, &ebbgpioSubsys.su_group);
+   return configfs_register_subsystem(&ebbgpioSubsys);
+}
+
+/** @brief System suspend: arm the IRQs of the buttons as wake-up IRQs and turn the LEDs off
+ *  The LED state is saved and put back on resume. The IRQs of the buttons stay requested, so the SoC
+ *  can go into its deepest state and a press brings it back.
+ *  @param dev the ebbgpio device
+ *  @return returns 0, a button that can not wake the system does not stop the suspend
+ */
+static int __maybe_unused ebbgpio_suspend(struct device *dev){
+   int i;
+   mutex_lock(&configLock);
+   for (i = 0; i < numButtons; i++){
+      struct ebbgpio_button *b = &buttons[i];
+      if (!b->up || bench) continue;
+      WRITE_ONCE(b->wakeArmed, true);
+      b->wake = device_may_wakeup(dev) && !enable_irq_wake(b->irq);
+   }
+   mutex_unlock(&configLock);
+   ledSaved = READ_ONCE(ledOn);
+   ledRestore = true;
+   ebbgpio_leds_update(0, ~0UL, 0);          // Dark while suspended
+   return 0;
+}
+
+/** @brief System resume, noirq phase: put the LEDs back exactly as they were at the suspend
+ *  The PM core resumes the device IRQs right after this phase, so the edge that woke the system
+ *  reaches the top half (see ebbgpio_wake_edge()) before ebbgpio_resume(), and its rules act on
+ *  the restored state instead of being undone by it.
+ *  @param dev the ebbgpio device
+ *  @return returns 0
+ */
+static int __maybe_unused ebbgpio_resume_noirq(struct device *dev){
+   if (ledRestore) ebbgpio_leds_update(ledSaved, ~ledSaved, 0);
+   ledRestore = false;
+   return 0;
+}
+
+/** @brief System resume: write the LEDs again and disarm the wake-up IRQs
+ *  By now the IRQs are back and the wake press may have run, see ebbgpio_resume_noirq().
+ *  @param dev the ebbgpio device
+ *  @return returns 0
+ */
+static int __maybe_unused ebbgpio_resume(struct device *dev){
+   int i;
+   ebbgpio_resume_noirq(dev);                // A suspend that failed before the noirq phase skips it
+   ebbgpio_leds_rewrite();                   // The GPIO controller may have been powered down
+   mutex_lock(&configLock);
+   for (i = 0; i < numButtons; i++){
+      struct ebbgpio_button *b = &buttons[i];
+      if (b->wake) disable_irq_wake(b->irq);
+      b->wake = false;
+   }
+   mutex_unlock(&configLock);
+   return 0;
+}
+
+/** @brief The end of a resume: an edge from now on is a normal edge, not the one that woke us
+ *  @param dev the ebbgpio device
+ */
+static void __maybe_unused ebbgpio_complete(struct device *dev){
+   int i;
+   for (i = 0; i < numButtons; i++) WRITE_ONCE(buttons[i].wakeArmed, false);
+}
+
+static const struct dev_pm_ops ebbgpio_pm_ops = {
+   SET_SYSTEM_SLEEP_PM_OPS(ebbgpio_suspend, ebbgpio_resume)
+#ifdef CONFIG_PM_SLEEP
+   .resume_noirq = ebbgpio_resume_noirq,
+   .complete = ebbgpio_complete,
+#endif
+};
+
+static const struct of_device_id ebbgpio_of_match[] = {
+   { .compatible = "derekmolloy,ebbgpio" },
+   { }
+};
+MODULE_DEVICE_TABLE(of, ebbgpio_of_match);
+
+static struct platform_driver ebbgpio_driver = {
+   .probe  = ebbgpio_probe,
+   .remove = ebbgpio_remove,
+   .driver = {
+      .name           = "ebbgpio",
+      .of_match_table = ebbgpio_of_match,
+      .probe_type     = PROBE_PREFER_ASYNCHRONOUS,   // Boot does not wait for the GPIOs and IRQs
+      .pm             = &ebbgpio_pm_ops,
+      .suppress_bind_attrs = true,          // An unbind would free the ring under open /dev/ebbgpio files
+   },
+};
+
 /** @brief The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file. The __init
  *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
  *  time and that it can be discarded and its memory freed up after that point. In this example this
- *  function sets up the GPIOs and the IRQ
+ *  function registers the platform driver. Without a matching device tree node a device is created
+ *  here, so the module parameters alone are still enough to bring up the table.
  *  @return returns 0 if successful
  */
 static int __init ebbgpio_init(void){
-   int resultA = 0;
-   int resultB = 0;
-   int resultC = 0;
-   int resultD = 0;
+   struct device_node *np;
+   int result;
    printk(KERN_INFO "GPIO_TEST: Initializing the GPIO_TEST LKM\n");
-   // Is the GPIO a valid GPIO number (e.g., the BBB has 4x32 but not all available)
-   if (!gpio_is_valid(gpioLED1)){
-      printk(KERN_INFO "GPIO_TEST: invalid LED 1 GPIO\n");
-      return -ENODEV;
-   }
-
-   if (!gpio_is_valid(gpioLED2)){
-	   printk(KERN_INFO "GPIO_TEST: invalid LED 2 GPIO\n");
-	   return -ENODEV;
-   }
-   // Going to set up the LED. It is a GPIO in output mode and will be on by default
-   led1On = true;
-   led2On = true;
-   gpio_request(gpioLED1, "sysfs");          // gpioLED is hardcoded to 49, request it
-   gpio_request(gpioLED2, "sysfs");
-   gpio_direction_output(gpioLED1, led1On);   // Set the gpio to be in output mode and on
-   gpio_direction_output(gpioLED2, led2On);
-// gpio_set_value(gpioLED, ledOn);          // Not required as set by line above (here for reference)
-   gpio_export(gpioLED1, false);             // Causes gpio49 to appear in /sys/class/gpio
-   gpio_export(gpioLED2, false);
-                     // the bool argument prevents the direction from being changed
-   gpio_request(gpioButtonA, "sysfs");       // Set up the gpioButton
-   gpio_direction_input(gpioButtonA);        // Set the button GPIO to be an input
-   gpio_set_debounce(gpioButtonA, 200);      // Debounce the button with a delay of 200ms
-   gpio_request(gpioButtonB, "sysfs");
-   gpio_direction_input(gpioButtonB);
-   gpio_set_debounce(gpioButtonB, 200);
-   gpio_request(gpioButtonC, "sysfs");
-   gpio_direction_input(gpioButtonC);
-   gpio_set_debounce(gpioButtonC, 200);
-   gpio_request(gpioButtonD, "sysfs");
-   gpio_direction_input(gpioButtonD);
-   gpio_set_debounce(gpioButtonD, 200);
-
-   // Perform a quick test to see that the button is working as expected on LKM load
-   printk(KERN_INFO "GPIO_TEST: The button A state is currently: %d\n", gpio_get_value(gpioButtonA));
-   printk(KERN_INFO "GPIO_TEST: The button B state is currently: %d\n", gpio_get_value(gpioButtonB));
-   printk(KERN_INFO "GPIO_TEST: The button C state is currently: %d\n", gpio_get_value(gpioButtonC));
-   printk(KERN_INFO "GPIO_TEST: The button D state is currently: %d\n", gpio_get_value(gpioButtonD));
- 
-   // GPIO numbers and IRQ numbers are not the same! This function performs the mapping for us
-   irqNumberA = gpio_to_irq(gpioButtonA);
-   printk(KERN_INFO "GPIO_TEST: The button A is mapped to IRQ: %d\n", irqNumberA);
-   irqNumberB = gpio_to_irq(gpioButtonB);
-   printk(KERN_INFO "GPIO_TEST: The button B is mapped to IRQ: %d\n", irqNumberB);
-   irqNumberC = gpio_to_irq(gpioButtonC);
-   printk(KERN_INFO "GPIO_TEST: The button C is mapped to IRQ: %d\n", irqNumberC);
-   irqNumberD = gpio_to_irq(gpioButtonD);
-   printk(KERN_INFO "GPIO_TEST: The button D is mapped to IRQ: %d\n", irqNumberD);
-
- 
-   // This next call requests an interrupt line
-   resultA = request_irq(irqNumberA,             // The interrupt number requested
-                        (irq_handler_t) ebbgpio_irq_handlerA, // The pointer to the handler function below
-                        IRQF_TRIGGER_RISING,   // Interrupt on rising edge (button press, not release)
-                        "ebb_gpio_handler",    // Used in /proc/interrupts to identify the owner
-                        NULL);                 // The *dev_id for shared interrupt lines, NULL is okay
- 
-   resultB = request_irq(irqNumberB,             // The interrupt number requested
-                        (irq_handler_t) ebbgpio_irq_handlerB, // The pointer to the handler function below
-                        IRQF_TRIGGER_RISING,   // Interrupt on rising edge (button press, not release)
-                        "ebb_gpio_handler",    // Used in /proc/interrupts to identify the owner
-                        NULL);                 // The *dev_id for shared interrupt lines, NULL is okay
-   resultC = request_irq(irqNumberC,             // The interrupt number requested
-                        (irq_handler_t) ebbgpio_irq_handlerC, // The pointer to the handler function below
-                        IRQF_TRIGGER_RISING,   // Interrupt on rising edge (button press, not release)
-                        "ebb_gpio_handler",    // Used in /proc/interrupts to identify the owner
-                        NULL);                 // The *dev_id for shared interrupt lines, NULL is okay
-   resultD = request_irq(irqNumberD,             // The interrupt number requested
-                        (irq_handler_t) ebbgpio_irq_handlerD, // The pointer to the handler function below
-                        IRQF_TRIGGER_RISING,   // Interrupt on rising edge (button press, not release)
-                        "ebb_gpio_handler",    // Used in /proc/interrupts to identify the owner
-                        NULL);                 // The *dev_id for shared interrupt lines, NULL is okay
-  
-   printk(KERN_INFO "GPIO_TEST: The interrupt request result is: %d\n", resultA);
-   return resultA;
+   result = ebbgpio_configfs_register();
+   if (result) return result;
+   result = platform_driver_register(&ebbgpio_driver);
+   if (result){
+      configfs_unregister_subsystem(&ebbgpioSubsys);
+      return result;
+   }
+   np = of_find_matching_node(NULL, ebbgpio_of_match);
+   of_node_put(np);
+   if (np) return 0;                         // The device tree provides the device
+   ebbgpioPdev = platform_device_register_simple("ebbgpio", PLATFORM_DEVID_NONE, NULL, 0);
+   if (IS_ERR(ebbgpioPdev)){
+      result = PTR_ERR(ebbgpioPdev);
+      ebbgpioPdev = NULL;
+      platform_driver_unregister(&ebbgpio_driver);
+      configfs_unregister_subsystem(&ebbgpioSubsys);
+      printk(KERN_INFO "GPIO_TEST: failed to create the ebbgpio device: %d\n", result);
+   }
+   return result;
 }
  
 /** @brief The LKM cleanup function
  *  Similar to the initialization function, it is static. The __exit macro notifies that if this
- *  code is used for a built-in driver (not a LKM) that this function is not required. Used to release the
- *  GPIOs and display cleanup messages.
+ *  code is used for a built-in driver (not a LKM) that this function is not required. Unregistering
+ *  the driver unbinds the device, which releases the GPIOs and the IRQs.
  */
 static void __exit ebbgpio_exit(void){
-   printk(KERN_INFO "GPIO_TEST: The button state is currently: %d\n", gpio_get_value(gpioButtonD));
-   printk(KERN_INFO "GPIO_TEST: The button was pressed %d times\n", numberPressesD);
-   gpio_set_value(gpioLED1, 0);              // Turn the LED off, makes it clear the device was unloaded
-   gpio_set_value(gpioLED2, 0);
-   gpio_unexport(gpioLED1);                  // Unexport the LED GPIO
-   gpio_unexport(gpioLED2);
-   free_irq(irqNumberA, NULL);               // Free the IRQ number, no *dev_id required in this case
-   gpio_unexport(gpioButtonA);               // Unexport the Button GPIO
-   free_irq(irqNumberB, NULL);
-   gpio_unexport(gpioButtonB);
-   free_irq(irqNumberC, NULL);
-   gpio_unexport(gpioButtonC);
-   free_irq(irqNumberD, NULL);
-   gpio_unexport(gpioButtonD);
-   gpio_free(gpioLED1);                      // Free the LED GPIO
-   gpio_free(gpioLED2);
-   gpio_free(gpioButtonA);
-   gpio_free(gpioButtonB);
-   gpio_free(gpioButtonC);
-   gpio_free(gpioButtonD);                   // Free the Button GPIO
-   printk(KERN_INFO "Button A has been pressed %d times.", numberPressesA);
-   printk(KERN_INFO "Button B has been pressed %d times.", numberPressesB);
-   printk(KERN_INFO "Button C has been pressed %d times.", numberPressesC);
-   printk(KERN_INFO "Button D has been pressed %d times.", numberPressesD);
+   platform_device_unregister(ebbgpioPdev);  // NULL if the device came from the device tree
+   platform_driver_unregister(&ebbgpio_driver);
+   configfs_unregister_subsystem(&ebbgpioSubsys);   // Empty by now, its items pin the module
    printk(KERN_INFO "GPIO_TEST: Goodbye from the LKM!\n");
 }
  
-/** @brief The GPIO IRQ Handler function
- *  This function is a custom interrupt handler that is attached to the GPIO above. The same interrupt
- *  handler cannot be invoked concurrently as the interrupt line is masked out until the function is complete.
- *  This function is static as it should not be invoked directly from outside of this file.
- *  @param irq    the IRQ number that is associated with the GPIO -- useful for logging.
- *  @param dev_id the *dev_id that is provided -- can be used to identify which device caused the interrupt
- *  Not used in this example as NULL is passed.
- *  @param regs   h/w specific register values -- only really ever used for debugging.
- *  return returns IRQ_HANDLED if successful -- should return IRQ_NONE otherwise.
- */
-static irq_handler_t ebbgpio_irq_handlerA(unsigned int irq, void *dev_id, struct pt_regs *regs){
-   led1On = true;                          // Invert the LED state on each button press
-   gpio_set_value(gpioLED1, led1On);          // Set the physical LED accordingly
-   printk(KERN_INFO "GPIO_TEST: Interrupt! (button A state is %d)\n", gpio_get_value(gpioButtonA));
-   call_usermodehelper(argv1[0], argv1, envp, UMH_NO_WAIT);
-   numberPressesA++;                         // Global counter, will be outputted when the module is unloaded
-   return (irq_handler_t) IRQ_HANDLED;      // Announce that the IRQ has been handled correctly
+/** @brief Move the calling IRQ thread to the configured real-time priority and CPUs
+ *  The kernel creates IRQ threads as SCHED_FIFO at priority 50, and moves them to the CPUs of their
+ *  IRQ whenever its affinity changes. The checks are cheap, so they are simply repeated on every run
+ *  of the thread instead of keeping a per-thread "done" flag.
+ */
+static void ebbgpio_tune_thread(void){
+   struct sched_attr attr = {
+      .sched_policy   = SCHED_FIFO,
+      .sched_priority = irqPriority,
+   };
+   mutex_lock(&affinityLock);                // Uncontended unless threadCpus is being written
+   if (!cpumask_empty(&threadCpuMask) && !cpumask_equal(current->cpus_ptr, &threadCpuMask))
+      set_cpus_allowed_ptr(current, &threadCpuMask);
+   mutex_unlock(&affinityLock);
+   if (current->policy == SCHED_FIFO && current->rt_priority == irqPriority) return;
+   if (sched_setattr_nocheck(current, &attr))
+      printk_ratelimited(KERN_INFO "GPIO_TEST: failed to set the IRQ thread priority to %d\n", irqPriority);
 }
- 
-static irq_handler_t ebbgpio_irq_handlerB(unsigned int irq, void *dev_id, struct pt_regs *regs){
-   led1On = false;                          // Invert the LED state on each button press
-   gpio_set_value(gpioLED1, led1On);          // Set the physical LED accordingly
-   printk(KERN_INFO "GPIO_TEST: Interrupt! (button B state is %d)\n", gpio_get_value(gpioButtonB));
-   call_usermodehelper(argv2[0], argv2, envp, UMH_NO_WAIT);
-   numberPressesB++;                         // Global counter, will be outputted when the module is unloaded
-   return (irq_handler_t) IRQ_HANDLED;      // Announce that the IRQ has been handled correctly
+
+/** @brief Allocate the event ring, called before any producer or consumer can run
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_ring_init(void){
+   u32 size, i;
+   if (ringSize < 16 || ringSize > 65536){
+      printk(KERN_INFO "GPIO_TEST: invalid ring size %u\n", ringSize);
+      return -EINVAL;
+   }
+   size = roundup_pow_of_two(ringSize);
+   // vmalloc_user() zeroes the area and marks it as safe to map into user space
+   eventRing.ctrl = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(size * sizeof(struct ebbgpio_slot)));
+   if (!eventRing.ctrl) return -ENOMEM;
+   eventRing.slots = (void *)eventRing.ctrl + PAGE_SIZE;
+   eventRing.mask = size - 1;
+   eventRing.ctrl->size = size;
+   eventRing.ctrl->slot_size = sizeof(struct ebbgpio_slot);
+   eventRing.ctrl->data_offset = PAGE_SIZE;
+   eventRing.ctrl->clock = useBoottime ? CLOCK_BOOTTIME : CLOCK_MONOTONIC;
+   for (i = 0; i < size; i++)
+      eventRing.slots[i].seq = i - size;       // One lap behind, i.e. not yet written
+   atomic_set(&coalescePending, 0);
+   hrtimer_init(&coalesceTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+   coalesceTimer.function = ebbgpio_coalesce_timer;
+   return 0;
 }
 
-static irq_handler_t ebbgpio_irq_handlerC(unsigned int irq, void *dev_id, struct pt_regs *regs){
-   led2On = true;                          // Invert the LED state on each button press
-   gpio_set_value(gpioLED2, led2On);          // Set the physical LED accordingly
-   printk(KERN_INFO "GPIO_TEST: Interrupt! (button C state is %d)\n", gpio_get_value(gpioButtonC));
-   call_usermodehelper(argv3[0], argv3, envp, UMH_NO_WAIT);
-   numberPressesC++;                         // Global counter, will be outputted when the module is unloaded
-   return (irq_handler_t) IRQ_HANDLED;      // Announce that the IRQ has been handled correctly
+/** @brief Free the event ring, once nothing can produce or map it any more */
+static void ebbgpio_ring_free(void){
+   hrtimer_cancel(&coalesceTimer);
+   cancel_work_sync(&wakeWork);              // After the timer, which may queue it
+   vfree(eventRing.ctrl);
+   eventRing.ctrl = NULL;
 }
 
-static irq_handler_t ebbgpio_irq_handlerD(unsigned int irq, void *dev_id, struct pt_regs *regs){
-   led2On = false;                          // Invert the LED state on each button press
-   gpio_set_value(gpioLED2, led2On);          // Set the physical LED accordingly
-   printk(KERN_INFO "GPIO_TEST: Interrupt! (button D state is %d)\n", gpio_get_value(gpioButtonD));
-   call_usermodehelper(argv4[0], argv4, envp, UMH_NO_WAIT);
-   numberPressesD++;                         // Global counter, will be outputted when the module is unloaded
-   return (irq_handler_t) IRQ_HANDLED;      // Announce that the IRQ has been handled correctly
+/** @brief Check whether a reader has something to return: an event, or the news of an overrun
+ *  @param r the reader
+ *  @return returns true if a read() would not block
+ */
+static bool ebbgpio_reader_ready(struct ebbgpio_reader *r){
+   u32 pos = READ_ONCE(r->pos);
+   struct ebbgpio_slot *slot = &eventRing.slots[pos & eventRing.mask];
+   return READ_ONCE(r->lost) || (s32)(smp_load_acquire(&slot->seq) - pos) >= 0;   // Pairs with push
 }
-/// This next calls are  mandatory -- they identify the initialization function
-/// and the cleanup function (as above).
-module_init(ebbgpio_init);
-module_exit(ebbgpio_exit);
+
+/** @brief Take the event at the position of a reader, called under the lock of the reader
+ *  The event is copied out and the slot seq checked again afterwards, as a producer may reuse the
+ *  slot at any time. On an overrun the reader skips to the oldest event that can still be in the
+ *  ring and counts the events it jumped over in lost.
+ *  @param r  the reader
+ *  @param ev the event, filled in if one is returned
+ *  @return returns true if an event was taken, false if the next one is not there yet or was lost
+ */
+static bool ebbgpio_reader_next(struct ebbgpio_reader *r, struct ebbgpio_event *ev){
+   struct ebbgpio_ring_ctrl *ctrl = eventRing.ctrl;
+   struct ebbgpio_slot *slot = &eventRing.slots[r->pos & eventRing.mask];
+   u32 seq = smp_load_acquire(&slot->seq), oldest, dropped;
+   if (seq == r->pos){
+      *ev = slot->event;
+      smp_rmb();                             // The copy is done before seq is checked again
+      if (READ_ONCE(slot->seq) == r->pos){
+         r->pos++;
+         return true;
+      }
+   }
+   else if ((s32)(seq - r->pos) < 0) return false;   // Not written yet
+   oldest = READ_ONCE(ctrl->head) - eventRing.mask - 1;
+   if ((s32)(oldest - r->pos) <= 0) oldest = r->pos + 1;   // The slot itself is being rewritten
+   r->lost += oldest - r->pos;
+   do {                                      // Rare, so a cmpxchg loop is fine for the counter
+      dropped = READ_ONCE(ctrl->dropped);
+   } while (cmpxchg(&ctrl->dropped, dropped, dropped + (oldest - r->pos)) != dropped);
+   r->pos = oldest;
+   return false;
+}
+
+/** @brief Convert a time of the IRQ path (CLOCK_MONOTONIC) to the clock of the timestamps
+ *  @param time the monotonic time
+ *  @return returns the timestamp in nanoseconds
+ */
+static u64 ebbgpio_timestamp(ktime_t time){
+   if (useBoottime) time = ktime_mono_to_any(time, TK_OFFS_BOOT);
+   return ktime_to_ns(time);
+}
+
+/** @brief Take the next record of a reader: its next event, or an EBBGPIO_EVENT_OVERRUN record in
+ *  place of the events it lost. Called under the lock of the reader.
+ *  @param r  the reader
+ *  @param ev the record, filled in if one is returned
+ *  @return returns true if a record was taken, false if the reader has caught up
+ */
+static bool ebbgpio_reader_take(struct ebbgpio_reader *r, struct ebbgpio_event *ev){
+   if (!r->lost && ebbgpio_reader_next(r, ev)) return true;
+   if (!r->lost) return false;
+   memset(ev, 0, sizeof(*ev));               // Report the gap where it is, before the events after it
+   ev->timestamp = ebbgpio_timestamp(ktime_get());
+   ev->edge      = EBBGPIO_EVENT_OVERRUN;
+   ev->duration  = r->lost;
+   r->lost = 0;
+   return true;
+}
+
+/** @brief Wake the readers of /dev/ebbgpio. Only the readers that are sleeping are woken, a
+ *  consumer that is still draining the ring does not need a wakeup.
+ *  @param work wakeWork, or NULL when called directly
+ */
+static void ebbgpio_wake_work(struct work_struct *work){
+   if (wq_has_sleeper(&eventWait))           // Orders the publish against the check, pairs with poll
+      wake_up_interruptible(&eventWait);     // Wake any blocked readers and pollers
+   kill_fasync(&eventAsync, SIGIO, POLL_IN); // and signal the O_ASYNC ones
+}
+
+/** @brief Wake the readers of /dev/ebbgpio from any context. The wait queue lock and the fasync
+ *  rwlock sleep on PREEMPT_RT, so there the wakeup is left to wakeWork whenever the caller can not
+ *  sleep: in hard-IRQ context (the HARD hrtimers) and under a raw lock with the IRQs off (the gesture
+ *  engine runs its rules under g->lock). The force-threaded top half of RT can wake them directly.
+ */
+static void ebbgpio_wake_readers(void){
+   if (IS_ENABLED(CONFIG_PREEMPT_RT) && (in_irq() || irqs_disabled()))
+      queue_work(system_highpri_wq, &wakeWork);
+   else ebbgpio_wake_work(NULL);
+}
+
+/** @brief Count an event that was just published, and wake the readers if it completes a batch.
+ *  The first event of a batch starts coalesceTimer instead. Safe in any context.
+ */
+static void ebbgpio_coalesce(void){
+   unsigned int pending = atomic_inc_return(&coalescePending), us = READ_ONCE(coalesceUs);
+   if (pending >= READ_ONCE(coalesceEvents) || !us){
+      atomic_set(&coalescePending, 0);
+      hrtimer_try_to_cancel(&coalesceTimer); // Can not wait here, a timer that still runs just wakes too
+      ebbgpio_wake_readers();
+   }
+   else if (pending == 1) hrtimer_start(&coalesceTimer, us_to_ktime(us), HRTIMER_MODE_REL_HARD);
+}
+
+/** @brief The end of a coalescing window, wakes the readers for the events of an incomplete batch
+ *  @param timer coalesceTimer
+ *  @return HRTIMER_NORESTART, the next event starts the timer again
+ */
+static enum hrtimer_restart ebbgpio_coalesce_timer(struct hrtimer *timer){
+   atomic_set(&coalescePending, 0);
+   ebbgpio_wake_readers();
+   return HRTIMER_NORESTART;
+}
+
+/** @brief Queue an event for the readers of /dev/ebbgpio
+ *  Lock-free and safe to call from any context, including the top halves on several CPUs at once.
+ *  The event always goes in, over the oldest one, so the IRQ path never waits for a reader; the
+ *  slot seq is set to the position before (which no reader of this slot can be at) while the slot
+ *  is rewritten, so a reader still on the old event sees the overrun. The wakeup of the readers is
+ *  left to ebbgpio_coalesce().
+ *  @param button the index of the button, 0 is button A
+ *  @param edge     one of the EBBGPIO_EDGE_* or EBBGPIO_EVENT_* values
+ *  @param time     the time of the edge as captured by the top half
+ *  @param duration how long the button has been held in microseconds, 0 for a press
+ *  @param seq      the sequence number of the edge the event comes from
+ *  @param held     the buttons held in the latest bank sample
+ */
+static void ebbgpio_push_event(unsigned int button, unsigned int edge, ktime_t time, u32 duration, u32 seq,
+                               unsigned long held){
+   struct ebbgpio_ring_ctrl *ctrl = eventRing.ctrl;
+   struct ebbgpio_slot *slot;
+   u32 head;
+   do {
+      head = READ_ONCE(ctrl->head);
+   } while (cmpxchg(&ctrl->head, head, head + 1) != head);
+   slot = &eventRing.slots[head & eventRing.mask];
+   WRITE_ONCE(slot->seq, head - 1);          // Take the old event away from its readers first
+   smp_wmb();
+   slot->event.timestamp = ebbgpio_timestamp(time);
+   slot->event.button    = button;
+   slot->event.edge      = edge;
+   slot->event.duration  = duration;
+   slot->event.seq       = seq;
+   slot->event.held      = held;
+   smp_store_release(&slot->seq, head);      // Publish the event to the consumers
+   ebbgpio_coalesce();
+   if (!READ_ONCE(genlReady)) return;
+   if (!genl_has_listeners(&ebbgpio_genl_family, &init_net, 0)){
+      if (!READ_ONCE(genlIdle)) WRITE_ONCE(genlIdle, true);
+      return;
+   }
+   if (READ_ONCE(genlIdle) && xchg(&genlIdle, false)){   // The first event since someone joined
+      WRITE_ONCE(genlStart, head);
+      smp_store_release(&genlRestart, true);
+   }
+   schedule_delayed_work(&genlWork, msecs_to_jiffies(netlinkMs));   // A no-op if a batch is pending
+}
+
+/** @brief Write the LEDs that are up with one array write, called under ledLock. The LEDs of
+ *  ledFast are written to the set and clear registers of their controller first.
+ *  @param state the state of all the LEDs, one bit per LED
+ */
+static void ebbgpio_leds_write(unsigned long state){
+   struct gpio_desc *descs[EBBGPIO_MAX_LEDS];
+   unsigned long value = 0;
+   u32 set[2] = {0, 0}, clear[2] = {0, 0};
+   unsigned int led, n = 0, bank;
+   for_each_set_bit(led, &ledMask, EBBGPIO_MAX_LEDS){   // At most a word of LEDs, cheap to gather
+      if (test_bit(led, &ledFast)){
+         if (test_bit(led, &state)) set[ledHw[led] / 32] |= BIT(ledHw[led] % 32);
+         else clear[ledHw[led] / 32] |= BIT(ledHw[led] % 32);
+         continue;
+      }
+      if (test_bit(led, &state)) __set_bit(n, &value);
+      descs[n++] = ledDescs[led];
+   }
+   for (bank = 0; ledFast && bank < 2; bank++){   // Raw levels, as with the array write
+      if (set[bank]) writel(set[bank], ledRegs + BCM2835_GPSET0 + 4 * bank);
+      if (clear[bank]) writel(clear[bank], ledRegs + BCM2835_GPCLR0 + 4 * bank);
+   }
+   if (n) gpiod_set_raw_array_value(n, descs, NULL, &value);   // Same raw polarity as gpio_set_value
+}
+
+/** @brief Write the LEDs again even if ledOn has not changed, the GPIOs may have lost their state */
+static void ebbgpio_leds_rewrite(void){
+   unsigned long flags;
+   raw_spin_lock_irqsave(&ledLock, flags);
+   ledWritten = READ_ONCE(ledOn);
+   if (!bench) ebbgpio_leds_write(ledWritten);
+   raw_spin_unlock_irqrestore(&ledLock, flags);
+}
+
+/** @brief Change a group of LEDs and write all of them with a single array write, if anything changed
+ *  @param set    the LEDs to turn on
+ *  @param clear  the LEDs to turn off
+ *  @param toggle the LEDs to toggle
+ */
+static void ebbgpio_leds_update(unsigned long set, unsigned long clear, unsigned long toggle){
+   unsigned long old, new, changed, state, flags;
+   unsigned int led;
+   old = READ_ONCE(ledOn);
+   for (;;){
+      new = (((old | set) & ~clear) ^ toggle) & ledMask;
+      if (new == old) return;                // Already in that state, nothing to write
+      state = cmpxchg(&ledOn, old, new);
+      if (state == old) break;
+      old = state;                           // Another CPU changed an LED, apply ours on top of it
+   }
+   changed = old ^ new;
+   for_each_set_bit(led, &changed, numLeds) trace_ebbgpio_led(led, test_bit(led, &new));
+   raw_spin_lock_irqsave(&ledLock, flags);
+   state = READ_ONCE(ledOn);                 // Write the latest state, it may include a later change
+   if (state != ledWritten){                 // ... unless a later change has already written it
+      if (!bench) ebbgpio_leds_write(state);
+      ledWritten = state;
+   }
+   raw_spin_unlock_irqrestore(&ledLock, flags);
+}
+
+/** @brief Account one latency sample in the histogram of a button, lock-free
+ *  @param b     the button
+ *  @param stage one of the EBBGPIO_LAT_* stages
+ *  @param ns    the time since the edge in nanoseconds
+ */
+static void ebbgpio_latency(struct ebbgpio_button *b, int stage, s64 ns){
+   unsigned int bucket = ns > 0 ? min(fls64(ns), EBBGPIO_LAT_BUCKETS - 1) : 0;
+   struct ebbgpio_stats *stats;
+   unsigned long flags;
+   this_cpu_inc(b->stats->latency[stage][bucket]);
+   local_irq_save(flags);
+   stats = this_cpu_ptr(b->stats);
+   if (ns > 0 && ns > stats->maxLatency[stage]){   // Rare once the worst case has been seen
+      raw_write_seqcount_begin(&stats->seq);
+      stats->maxLatency[stage] = ns;
+      raw_write_seqcount_end(&stats->seq);
+   }
+   local_irq_restore(flags);
+}
+
+/** @brief Bump one counter of a button, lock-free and from any context
+ *  @param b       the button
+ *  @param counter one of the EBBGPIO_STAT_* counters
+ */
+static void ebbgpio_count(struct ebbgpio_button *b, int counter){
+   struct ebbgpio_stats *stats;
+   unsigned long flags;
+   local_irq_save(flags);                    // The writers of a CPU must not nest, see struct ebbgpio_stats
+   stats = this_cpu_ptr(b->stats);
+   raw_write_seqcount_begin(&stats->seq);
+   stats->count[counter]++;
+   raw_write_seqcount_end(&stats->seq);
+   local_irq_restore(flags);
+}
+
+/** @brief The BPF hook of the event pipeline. Every trigger of a button passes through here before
+ *  any of its rules run, and the function itself lets everything through. A kprobe program can
+ *  replace the return value with bpf_override_return() (CONFIG_BPF_KPROBE_OVERRIDE), as can an
+ *  fmod_ret program on kernels with module BTF:
+ *     < 0  drop the trigger: no LED, event or script rule runs and the filtered counter goes up
+ *       0  run the rules of the trigger as it is
+ *     > 0  run the rules of that EBBGPIO_EDGE_* or EBBGPIO_EVENT_* value instead
+ *  The counters, the input device and the gesture engine see the edges before the filter.
+ *  Not static and weak, so the call is kept and the symbol stays attachable by name.
+ *  @param button    the index of the button, 0 is button A
+ *  @param edge      the EBBGPIO_EDGE_* or EBBGPIO_EVENT_* value of the trigger
+ *  @param timestamp the time of the edge, as it would be in the event
+ *  @param duration  how long the button has been held in microseconds
+ *  @param seq       the number of the edge
+ *  @return returns 0 to let the trigger through unchanged
+ */
+__weak noinline int ebbgpio_filter_event(unsigned int button, unsigned int edge, u64 timestamp, u32 duration,
+                                         u32 seq){
+   return 0;
+}
+ALLOW_ERROR_INJECTION(ebbgpio_filter_event, ERRNO);
+
+/** @brief The EBBGPIO_EDGE_* or EBBGPIO_EVENT_* value of a trigger, as seen in the events
+ *  @param trigger one of the EBBGPIO_TRIG_* values, other than any
+ *  @return returns the edge value
+ */
+static unsigned int ebbgpio_trigger_edge(unsigned int trigger){
+   return trigger == EBBGPIO_TRIG_CHORD ? EBBGPIO_EVENT_CHORD : trigger + 1;
+}
+
+/** @brief Run the rules of a button for one trigger. The LED rules are merged into a single LED write,
+ *  the event rules queue one event and the script rules are left to the IRQ thread. Called from the
+ *  top half (or the debounce timer), so the table is only read under RCU. ebbgpio_filter_event()
+ *  gets the trigger first and may drop or replace it.
+ *  @param b       the button
+ *  @param trigger  one of the EBBGPIO_TRIG_* values, other than any
+ *  @param time     the time of the edge
+ *  @param duration how long the button has been held in microseconds, for the event
+ *  @param held     the buttons held in the bank sample of the edge, or in the latest one for a timer
+ */
+static void ebbgpio_rules_run(struct ebbgpio_button *b, unsigned int trigger, ktime_t time, u32 duration,
+                              unsigned long held){
+   const struct ebbgpio_rules *rules;
+   unsigned long set = 0, clear = 0, toggle = 0, pulse = 0;
+   unsigned int i, led, ms[EBBGPIO_MAX_LEDS];
+   bool event = false;
+   u32 seq = READ_ONCE(b->seq);
+   int verdict = ebbgpio_filter_event(b->index, ebbgpio_trigger_edge(trigger), ebbgpio_timestamp(time), duration, seq);
+   if (verdict < 0){                         // Dropped by a BPF program, nothing else to pay for
+      ebbgpio_count(b, EBBGPIO_STAT_FILTERED);
+      return;
+   }
+   if (verdict == EBBGPIO_EVENT_CHORD) trigger = EBBGPIO_TRIG_CHORD;
+   else if (verdict > 0 && verdict <= EBBGPIO_EVENT_REPEAT) trigger = verdict - 1;
+   rcu_read_lock();
+   rules = rcu_dereference(ruleTable);
+   for (i = 0; i < rules->count; i++){
+      const struct ebbgpio_rule *r = &rules->rule[i];
+      if (r->trigger == EBBGPIO_TRIG_CHORD){   // Fired by any of its buttons once all of them are held
+         if (trigger != EBBGPIO_TRIG_CHORD || !test_bit(b->index, &r->chord) || (held & r->chord) != r->chord)
+            continue;
+      }
+      else if (r->button != b->index || (r->trigger != trigger &&
+               (r->trigger != EBBGPIO_TRIG_ANY || trigger == EBBGPIO_TRIG_CHORD))) continue;
+      switch (r->action){
+      case EBBGPIO_ACTION_ON:     set |= r->leds;    break;
+      case EBBGPIO_ACTION_OFF:    clear |= r->leds;  break;
+      case EBBGPIO_ACTION_TOGGLE: toggle |= r->leds; break;
+      case EBBGPIO_ACTION_PULSE:
+         set |= r->leds;
+         pulse |= r->leds;
+         for_each_set_bit(led, &r->leds, numLeds) ms[led] = r->ms;
+         break;
+      case EBBGPIO_ACTION_EVENT:  event = true;      break;
+      case EBBGPIO_ACTION_SCRIPT: set_bit(EBBGPIO_ACTION_SCRIPT, &b->deferred); break;
+      }
+   }
+   rcu_read_unlock();
+   if (set | clear | toggle){
+      ebbgpio_leds_update(set, clear, toggle);   // Set the physical LEDs accordingly
+      ebbgpio_latency(b, EBBGPIO_LAT_LED, ktime_to_ns(ktime_sub(ktime_get(), time)));
+   }
+   for_each_set_bit(led, &pulse, numLeds)    // Started after the LEDs are on, a restart extends the pulse
+      hrtimer_start(&ledPulse[led], ms_to_ktime(ms[led]), HRTIMER_MODE_REL_HARD);
+   if (event)                                // Lock-free, so cheap enough for the top half
+      ebbgpio_push_event(b->index, ebbgpio_trigger_edge(trigger), time, duration, seq, held);
+}
+
+/** @brief The end of an LED pulse
+ *  @param timer the ledPulse timer of the LED
+ *  @return HRTIMER_NORESTART, a new pulse restarts the timer
+ */
+static enum hrtimer_restart ebbgpio_pulse_timer(struct hrtimer *timer){
+   ebbgpio_leds_update(0, BIT(timer - ledPulse), 0);
+   return HRTIMER_NORESTART;
+}
+
+/** @brief Arm the gesture timer for the current state. Called with the gesture lock held
+ *  @param g  the gesture state of the button
+ *  @param ms when the state ends, from now
+ */
+static void ebbgpio_gesture_arm(struct ebbgpio_gesture *g, unsigned int ms){
+   g->deadline = ktime_add_ms(ktime_get(), ms);
+   hrtimer_start(&g->timer, g->deadline, HRTIMER_MODE_ABS_HARD);
+}
+
+/** @brief End the current gesture state: a long press, a repeat or the short press that was not
+ *  followed by a second click. An edge may have moved the state on while the timer waited for the
+ *  lock, in which case the deadline is in the future (or the state has no timer) and nothing is done.
+ */
+static enum hrtimer_restart ebbgpio_gesture_timer(struct hrtimer *timer){
+   struct ebbgpio_button *b = container_of(timer, struct ebbgpio_button, gesture.timer);
+   struct ebbgpio_gesture *g = &b->gesture;
+   enum hrtimer_restart restart = HRTIMER_NORESTART;
+   ktime_t now = ktime_get();
+   u32 held;
+   raw_spin_lock(&g->lock);
+   held = ktime_to_us(ktime_sub(now, g->pressTime));
+   if (!ktime_before(now, g->deadline)){
+      switch (g->state){
+      case GESTURE_DOWN:
+         g->state = GESTURE_LONG;
+         ebbgpio_rules_run(b, EBBGPIO_TRIG_LONG, now, held, READ_ONCE(bankHeld));
+         break;
+      case GESTURE_LONG:
+         ebbgpio_rules_run(b, EBBGPIO_TRIG_REPEAT, now, held, READ_ONCE(bankHeld));
+         break;
+      case GESTURE_UP:
+         g->state = GESTURE_IDLE;
+         ebbgpio_rules_run(b, EBBGPIO_TRIG_SHORT, now, g->duration, READ_ONCE(bankHeld));
+         break;
+      }
+      if (g->state == GESTURE_LONG && repeatMs){
+         g->deadline = ktime_add_ms(now, repeatMs);
+         hrtimer_set_expires(timer, g->deadline);
+         restart = HRTIMER_RESTART;
+      }
+   }
+   raw_spin_unlock(&g->lock);
+   if (READ_ONCE(b->deferred)) ebbgpio_wake_thread(b);   // A script rule fired
+   return restart;
+}
+
+/** @brief Feed a press or a release to the gesture state machine of a button
+ *  @param b     the button
+ *  @param down  true for a press, false for a release
+ *  @param time  the time of the edge
+ *  @param bank  the bank sample of the edge
+ */
+static void ebbgpio_gesture_edge(struct ebbgpio_button *b, bool down, ktime_t time, unsigned long bank){
+   struct ebbgpio_gesture *g = &b->gesture;
+   unsigned long flags;
+   u32 held;
+   if (!b->releases) return;                 // Without releases every press would turn into a long one
+   raw_spin_lock_irqsave(&g->lock, flags);
+   if (down){
+      if (g->state == GESTURE_UP){           // A second click soon enough
+         g->state = GESTURE_DOWN2;
+         ebbgpio_rules_run(b, EBBGPIO_TRIG_DOUBLE, time, 0, bank);
+      }
+      else {
+         g->state = GESTURE_DOWN;
+         ebbgpio_gesture_arm(g, longMs);
+      }
+      g->pressTime = time;
+   }
+   else {
+      held = ktime_to_us(ktime_sub(time, g->pressTime));
+      if (g->state == GESTURE_DOWN && doubleMs){
+         g->state = GESTURE_UP;              // Short, unless a second click follows
+         g->duration = held;
+         ebbgpio_gesture_arm(g, doubleMs);
+      }
+      else {
+         if (g->state == GESTURE_DOWN) ebbgpio_rules_run(b, EBBGPIO_TRIG_SHORT, time, held, bank);
+         g->state = GESTURE_IDLE;
+         hrtimer_try_to_cancel(&g->timer);   // If it is running it will find nothing to do
+      }
+   }
+   raw_spin_unlock_irqrestore(&g->lock, flags);
+}
+
+/** @brief Set up the gesture state machine of a button */
+static void ebbgpio_gesture_setup(struct ebbgpio_button *b){
+   struct ebbgpio_gesture *g = &b->gesture;
+   raw_spin_lock_init(&g->lock);
+   hrtimer_init(&g->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+   g->timer.function = ebbgpio_gesture_timer;
+   g->state = GESTURE_IDLE;
+}
+
+/** @brief The key code of a button on the input device
+ *  @param i the index of the button
+ *  @return returns the key code
+ */
+static unsigned int ebbgpio_key(unsigned int i){
+   return buttonKeys[i] ? buttonKeys[i] : BTN_TRIGGER_HAPPY1 + i;
+}
+
+/** @brief Report the key edges queued for the input device
+ *  evdev queues each event to each of its clients with the edge time, converted to the clock
+ *  the client picked with EVIOCSCLOCKID. After an overflow every key is reported as it is now, and
+ *  the input core drops the ones that did not change.
+ *  @param work inputWork
+ */
+static void ebbgpio_input_work(struct work_struct *work){
+   struct input_dev *input = READ_ONCE(ebbgpioInput);
+   struct ebbgpio_key_edge e;
+   bool overflow;
+   int i;
+   for (;;){
+      raw_spin_lock_irq(&inputLock);
+      if (inputTail == inputHead) break;     // Left with the lock held, for inputOverflow
+      e = inputQueue[inputTail++ % EBBGPIO_INPUT_QUEUE];
+      raw_spin_unlock_irq(&inputLock);
+      if (!input) continue;
+      input_set_timestamp(input, e.time);
+      input_report_key(input, ebbgpio_key(e.button), e.down);
+      if (e.click) input_report_key(input, ebbgpio_key(e.button), 0);
+      input_sync(input);
+   }
+   overflow = inputOverflow;
+   inputOverflow = false;
+   raw_spin_unlock_irq(&inputLock);
+   if (!overflow || !input) return;
+   for (i = 0; i < EBBGPIO_MAX_BUTTONS; i++) input_report_key(input, ebbgpio_key(i), READ_ONCE(buttons[i].down));
+   input_sync(input);
+}
+
+/** @brief Queue a press or a release for the input device, if there is one. Safe in any context
+ *  @param b    the button
+ *  @param down the button was pressed, else released
+ *  @param time the time of the edge
+ */
+static void ebbgpio_input_key(struct ebbgpio_button *b, bool down, ktime_t time){
+   struct ebbgpio_key_edge *e;
+   unsigned long flags;
+   if (!READ_ONCE(ebbgpioInput)) return;
+   raw_spin_lock_irqsave(&inputLock, flags);
+   if (inputHead - inputTail < EBBGPIO_INPUT_QUEUE){
+      e = &inputQueue[inputHead++ % EBBGPIO_INPUT_QUEUE];
+      e->time   = time;
+      e->button = b->index;
+      e->down   = down;
+      e->click  = down && !b->releases;      // No release will come
+   }
+   else inputOverflow = true;
+   raw_spin_unlock_irqrestore(&inputLock, flags);
+   queue_work(system_highpri_wq, &inputWork);   // A no-op while it is pending
+}
+
+/** @brief Check whether a press completes a chord rule, before the chord trigger is paid for
+ *  @param b    the button
+ *  @param held the bank sample of the press
+ *  @return returns true if all the buttons of a chord rule of the button are held
+ */
+static bool ebbgpio_chord_held(struct ebbgpio_button *b, unsigned long held){
+   const struct ebbgpio_rules *rules;
+   bool found = false;
+   unsigned int i;
+   rcu_read_lock();
+   rules = rcu_dereference(ruleTable);
+   for (i = 0; i < rules->count && !found; i++){
+      const struct ebbgpio_rule *r = &rules->rule[i];
+      found = r->trigger == EBBGPIO_TRIG_CHORD && test_bit(b->index, &r->chord) && (held & r->chord) == r->chord;
+   }
+   rcu_read_unlock();
+   return found;
+}
+
+/** @brief Accept a (debounced) press: count it and run the press rules of the button
+ *  and, if other buttons are held too, the chord rules it completes. Called from the top half, or
+ *  from the debounce timer once the press has been confirmed, after a sample of the bank.
+ *  @param b    the button
+ *  @param time the time of the edge that started the press
+ *  @param held the bank sample that found the button pressed
+ */
+static void ebbgpio_press(struct ebbgpio_button *b, ktime_t time, unsigned long held){
+   ebbgpio_count(b, EBBGPIO_STAT_PRESSES);
+   b->down = true;
+   ebbgpio_input_key(b, true, time);
+   ebbgpio_rules_run(b, EBBGPIO_TRIG_PRESS, time, 0, held);
+   if ((held & BIT(b->index)) && hweight_long(held) > 1 && ebbgpio_chord_held(b, held))
+      ebbgpio_rules_run(b, EBBGPIO_TRIG_CHORD, time, 0, held);
+   ebbgpio_gesture_edge(b, true, time, held);
+}
+
+/** @brief Accept a (debounced) release: run the release rules of the button with the press length
+ *  @param b    the button
+ *  @param time the time of the edge that ended the press
+ *  @param held the bank sample that found the button released
+ */
+static void ebbgpio_release(struct ebbgpio_button *b, ktime_t time, unsigned long held){
+   b->down = false;
+   ebbgpio_input_key(b, false, time);
+   ebbgpio_rules_run(b, EBBGPIO_TRIG_RELEASE, time, ktime_to_us(ktime_sub(time, b->gesture.pressTime)), held);
+   ebbgpio_gesture_edge(b, false, time, held);
+}
+
+/** @brief Hand the rest of an edge to the IRQ thread, from outside of the top half
+ *  @param b the button
+ */
+static void ebbgpio_wake_thread(struct ebbgpio_button *b){
+   if (threaded) irq_wake_thread(b->irq, b);
+   else ebbgpio_irq_thread(b->irq, b, NULL);
+}
+
+/** @brief Sample the lines of all the buttons at once and publish the result in bankHeld
+ *  Safe in any context, the lines are read with the non-sleeping array read.
+ *  @return returns the buttons that are pressed, one bit per button
+ */
+static unsigned long ebbgpio_bank_sample(void){
+   struct gpio_desc *descs[EBBGPIO_MAX_BUTTONS];
+   unsigned long value = 0, held = 0, flags;
+   unsigned int i, n = 0;
+   raw_spin_lock_irqsave(&bankLock, flags);
+   if (bench){
+      for_each_set_bit(i, &bankMask, EBBGPIO_MAX_BUTTONS)
+         if (READ_ONCE(buttons[i].simLevel)) __set_bit(i, &held);
+   }
+   else {
+      for_each_set_bit(i, &bankMask, EBBGPIO_MAX_BUTTONS) descs[n++] = buttons[i].desc;
+      if (n && !gpiod_get_raw_array_value(n, descs, NULL, &value)){
+         n = 0;
+         for_each_set_bit(i, &bankMask, EBBGPIO_MAX_BUTTONS)
+            if (test_bit(n++, &value)) __set_bit(i, &held);
+      }
+   }
+   WRITE_ONCE(bankHeld, held);               // Under the lock, so the samples are published in order
+   raw_spin_unlock_irqrestore(&bankLock, flags);
+   return held;
+}
+
+/** @brief Add a button to the bank samples or take it out, before its descriptor goes away
+ *  @param b  the button, its line must be ready
+ *  @param on add the button, else remove it
+ */
+static void ebbgpio_bank_set(struct ebbgpio_button *b, bool on){
+   unsigned long flags;
+   raw_spin_lock_irqsave(&bankLock, flags);
+   if (on) __set_bit(b->index, &bankMask);
+   else __clear_bit(b->index, &bankMask);
+   raw_spin_unlock_irqrestore(&bankLock, flags);
+}
+
+/** @brief Read the level of a button line, with a sample of the whole bank
+ *  @param b the button
+ *  @return returns 1 if the button is pressed
+ */
+static int ebbgpio_level(struct ebbgpio_button *b){
+   return !!(ebbgpio_bank_sample() & BIT(b->index));
+}
+
+/** @brief The debounce timer, runs at the end of every debounce window
+ *  After the first edge the line is re-sampled: if it is still high the press is accepted, otherwise
+ *  the edge was a glitch. The IRQ stays disabled for the window, so contact bounce can not turn into
+ *  an interrupt storm. With bothEdges=1 the IRQ is enabled again once the press is accepted, and the
+ *  first edge of the release starts a window of its own, so the release carries the time and number
+ *  of that edge like the press does. Without it the timer keeps re-sampling every window until the
+ *  button is released, the release is the first sample that finds the line low and counts as an
+ *  edge. An edge that bounced while the IRQ was disabled may be replayed once it is enabled, it is
+ *  simply dropped as the line has not changed.
+ */
+static enum hrtimer_restart ebbgpio_debounce_timer(struct hrtimer *timer){
+   struct ebbgpio_button *b = container_of(timer, struct ebbgpio_button, debounce.timer);
+   struct ebbgpio_debounce *d = &b->debounce;
+   unsigned long held = ebbgpio_bank_sample();
+   int level = !!(held & BIT(b->index));
+   if (d->state == DEBOUNCE_EDGE){
+      trace_ebbgpio_debounce(b->index, level, level);
+      if (level){
+         d->state = DEBOUNCE_HELD;           // A clean press, emit a single event for it
+         ebbgpio_press(b, d->edgeTime, held);
+         ebbgpio_wake_thread(b);
+         if (bothEdges){                     // The release edge ends the hold, see ebbgpio_debounce_edge()
+            enable_irq(b->irq);
+            return HRTIMER_NORESTART;
+         }
+         hrtimer_forward_now(timer, d->window);
+         return HRTIMER_RESTART;
+      }
+      ebbgpio_count(b, EBBGPIO_STAT_REJECTS);
+      if (verbose > 1)
+         printk_ratelimited(KERN_INFO "GPIO_TEST: Rejected a glitch on button %c\n", 'A' + b->index);
+   }
+   else if (level && d->state == DEBOUNCE_UP){   // The release edge was a glitch, still held
+      d->state = DEBOUNCE_HELD;
+      enable_irq(b->irq);
+      return HRTIMER_NORESTART;
+   }
+   else if (level){                          // Still held, look again after another window
+      hrtimer_forward_now(timer, d->window);
+      return HRTIMER_RESTART;
+   }
+   else {                                    // Released
+      if (d->state == DEBOUNCE_HELD){        // Found by a sample, which stands for the edge
+         d->edgeTime = ktime_get();
+         WRITE_ONCE(b->seq, b->seq + 1);
+      }
+      if (b->down){                          // Not already released by the polling of a storm
+         ebbgpio_release(b, d->edgeTime, held);
+         ebbgpio_wake_thread(b);
+      }
+   }
+   d->state = DEBOUNCE_IDLE;
+   enable_irq(b->irq);                       // Last, the next edge may start a window straight away
+   return HRTIMER_NORESTART;
+}
+
+/** @brief Hand an edge to the software debounce engine
+ *  @param b    the button
+ *  @param time the time of the edge
+ *  @param held the bank sample of the edge
+ *  @return returns true if the engine took the edge, false if the press should be accepted directly
+ */
+static bool ebbgpio_debounce_edge(struct ebbgpio_button *b, ktime_t time, unsigned long held){
+   struct ebbgpio_debounce *d = &b->debounce;
+   bool holding = d->state == DEBOUNCE_HELD && b->down;   // Not if the polling of a storm released it
+   if (!d->soft) return false;
+   if (bothEdges && !(held & BIT(b->index))){
+      if (!holding) return true;             // A replayed bounce, the line has not changed
+      d->state = DEBOUNCE_UP;                // The first edge of the release
+   }
+   else if (holding) return true;            // A bounce, the button is still held
+   else d->state = DEBOUNCE_EDGE;
+   disable_irq_nosync(b->irq);               // Ignore the bounces, we are called from this IRQ
+   d->edgeTime = time;
+   hrtimer_start(&d->timer, d->window, HRTIMER_MODE_REL_HARD);
+   return true;
+}
+
+/** @brief Set up debouncing for a button, in hardware if the GPIO controller supports it
+ *  @param b the button, its GPIO must already be an input
+ */
+static void ebbgpio_debounce_setup(struct ebbgpio_button *b){
+   struct ebbgpio_debounce *d = &b->debounce;
+   unsigned int us = debounceUs[b->index];
+   hrtimer_init(&d->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);   // Hard-IRQ context, even on RT
+   d->timer.function = ebbgpio_debounce_timer;
+   d->window = us_to_ktime(us);
+   d->state = DEBOUNCE_IDLE;
+   d->soft = !bench && us && gpiod_set_debounce(b->desc, us);   // Simulated lines never bounce
+   if (d->soft)
+      printk(KERN_INFO "GPIO_TEST: No hardware debounce for button %c, using a %u us software window\n",
+             'A' + b->index, us);
+}
+
+/** @brief Take a snapshot of the counters of a button, without stopping the IRQ path
+ *  @param b    the button
+ *  @param snap where the snapshot is returned
+ */
+static void ebbgpio_snapshot(struct ebbgpio_button *b, struct ebbgpio_snapshot *snap){
+   struct ebbgpio_snapshot cpuSnap;
+   unsigned int start, i;
+   int cpu;
+   memset(snap, 0, sizeof(*snap));
+   if (!b->stats) return;
+   for_each_possible_cpu(cpu){
+      const struct ebbgpio_stats *stats = per_cpu_ptr(b->stats, cpu);
+      do {                                   // Retry if the CPU updated a counter meanwhile
+         start = read_seqcount_begin(&stats->seq);
+         memcpy(cpuSnap.count, stats->count, sizeof(cpuSnap.count));
+         memcpy(cpuSnap.maxLatency, stats->maxLatency, sizeof(cpuSnap.maxLatency));
+      } while (read_seqcount_retry(&stats->seq, start));
+      for (i = 0; i < EBBGPIO_STATS; i++) snap->count[i] += cpuSnap.count[i];
+      for (i = 0; i < EBBGPIO_LAT_STAGES; i++) snap->maxLatency[i] = max(snap->maxLatency[i], cpuSnap.maxLatency[i]);
+   }
+}
+
+/** @brief Add up the per-CPU press counters of a button
+ *  @param b the button
+ *  @return returns the number of accepted presses
+ */
+static u64 ebbgpio_presses(struct ebbgpio_button *b){
+   struct ebbgpio_snapshot snap;
+   ebbgpio_snapshot(b, &snap);
+   return snap.count[EBBGPIO_STAT_PRESSES];
+}
+
+/** @brief Show the presses attribute of /sys/class/ebbgpio/buttonX */
+static ssize_t presses_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   return sprintf(buf, "%llu\n", ebbgpio_presses(b));
+}
+static DEVICE_ATTR_RO(presses);
+
+/** @brief Show the script_queued attribute: runs (or with coalesce, presses) waiting for the script */
+static ssize_t script_queued_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", atomic_read(&b->dispatch.pending));
+}
+static DEVICE_ATTR_RO(script_queued);
+
+/** @brief Show the script_running attribute: 1 while the script of the button runs */
+static ssize_t script_running_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", atomic_read(&b->dispatch.running));
+}
+static DEVICE_ATTR_RO(script_running);
+
+/** @brief Show the script_dropped attribute: presses whose script run was dropped */
+static ssize_t script_dropped_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", atomic_read(&b->dispatch.dropped));
+}
+static DEVICE_ATTR_RO(script_dropped);
+
+/** @brief Apply the affinity hint of a button IRQ, called with affinityLock held
+ *  @param b the button, its IRQ must be requested
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_irq_affinity(struct ebbgpio_button *b){
+   if (!b->ownAffinity) cpumask_copy(&b->affinity, &irqCpuMask);
+   if (cpumask_empty(&b->affinity)) return irq_set_affinity_hint(b->irq, NULL);   // Left where it is
+   return irq_set_affinity_hint(b->irq, &b->affinity);   // The IRQ thread follows the new CPUs
+}
+
+/** @brief Apply irqCpus and threadCpus to every button that is up. Setting the IRQ affinity again
+ *  also makes the kernel move each IRQ thread back to the CPUs of its IRQ, so clearing threadCpus
+ *  takes effect straight away; a non-empty threadCpus is applied by the thread on its next run.
+ */
+static void ebbgpio_affinity_apply(void){
+   int i, result;
+   mutex_lock(&affinityLock);
+   for (i = 0; i < numButtons; i++){
+      if (!buttons[i].affine) continue;
+      result = ebbgpio_irq_affinity(&buttons[i]);
+      if (result)
+         printk(KERN_INFO "GPIO_TEST: failed to set the affinity of button %c: %d\n", 'A' + i, result);
+   }
+   mutex_unlock(&affinityLock);
+}
+
+/** @brief Show the irq_affinity attribute: the CPUs of the button IRQ, empty for the kernel default */
+static ssize_t irq_affinity_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   ssize_t len;
+   mutex_lock(&affinityLock);
+   len = sprintf(buf, "%*pbl\n", cpumask_pr_args(&b->affinity));
+   mutex_unlock(&affinityLock);
+   return len;
+}
+
+/** @brief Set the CPUs of the button IRQ from a CPU list, an empty list goes back to irqCpus */
+static ssize_t irq_affinity_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   cpumask_var_t mask;
+   int result;
+   if (!alloc_cpumask_var(&mask, GFP_KERNEL)) return -ENOMEM;
+   result = cpulist_parse(buf, mask);
+   if (!result){
+      mutex_lock(&affinityLock);
+      b->ownAffinity = !cpumask_empty(mask);
+      cpumask_copy(&b->affinity, mask);
+      result = ebbgpio_irq_affinity(b);
+      mutex_unlock(&affinityLock);
+   }
+   free_cpumask_var(mask);
+   return result ? result : count;
+}
+static DEVICE_ATTR_RW(irq_affinity);
+
+/** @brief Show the storms attribute: times the button was switched to polling by an IRQ storm */
+static ssize_t storms_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   return sprintf(buf, "%u\n", READ_ONCE(b->storm.storms));
+}
+static DEVICE_ATTR_RO(storms);
+
+/** @brief Show the polling attribute: 1 while the button is polled instead of interrupting */
+static ssize_t polling_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebbgpio_button *b = dev_get_drvdata(dev);
+   return sprintf(buf, "%d\n", READ_ONCE(b->storm.polling));
+}
+static DEVICE_ATTR_RO(polling);
+
+static struct attribute *ebbgpio_button_attrs[] = {
+   &dev_attr_presses.attr,
+   &dev_attr_script_queued.attr,
+   &dev_attr_script_running.attr,
+   &dev_attr_script_dropped.attr,
+   &dev_attr_storms.attr,
+   &dev_attr_polling.attr,
+   &dev_attr_irq_affinity.attr,
+   NULL,
+};
+ATTRIBUTE_GROUPS(ebbgpio_button);
+
+/** @brief Allocate an empty rule table
+ *  @param count the number of rules it must hold
+ */
+static struct ebbgpio_rules *ebbgpio_rules_alloc(unsigned int count){
+   struct ebbgpio_rules *rules;
+   return kzalloc(struct_size(rules, rule, count), GFP_KERNEL);
+}
+
+/** @brief Install a new rule table, the old one is freed once no handler is still using it
+ *  Called with ruleLock held.
+ *  @param rules the new table
+ */
+static void ebbgpio_rules_publish(struct ebbgpio_rules *rules){
+   struct ebbgpio_rules *old = rcu_dereference_protected(ruleTable, lockdep_is_held(&ruleLock));
+   rcu_assign_pointer(ruleTable, rules);
+   if (old) kfree_rcu(old, rcu);
+}
+
+/** @brief Build the default rules from the module parameters. Each press turns the LED of the button
+ *  on, off or toggles it as set by buttonLed and buttonAction and runs its script, and every edge and
+ *  gesture of the button queues an event.
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_rules_init(void){
+   struct ebbgpio_rules *rules = ebbgpio_rules_alloc(3 * numButtons);
+   int i, action;
+   if (!rules) return -ENOMEM;
+   for (i = 0; i < numButtons; i++){
+      const char *name = buttonActions[i] ? buttonActions[i] : "none";
+      action = match_string(ebbgpio_action_names, EBBGPIO_ACTION_TOGGLE + 1, name);
+      if (action < 0 || (action != EBBGPIO_ACTION_NONE && buttonLeds[i] < 0)){
+         printk(KERN_INFO "GPIO_TEST: invalid action \"%s\" for button %c\n", name, 'A' + i);
+         kfree(rules);
+         return -EINVAL;
+      }
+      if (action != EBBGPIO_ACTION_NONE)
+         rules->rule[rules->count++] = (struct ebbgpio_rule){i, EBBGPIO_TRIG_PRESS, action, BIT(buttonLeds[i]), 0};
+      rules->rule[rules->count++] = (struct ebbgpio_rule){i, EBBGPIO_TRIG_ANY, EBBGPIO_ACTION_EVENT, 0, 0};
+      rules->rule[rules->count++] = (struct ebbgpio_rule){i, EBBGPIO_TRIG_PRESS, EBBGPIO_ACTION_SCRIPT, 0, 0};
+   }
+   rcu_assign_pointer(ruleTable, rules);
+   return 0;
+}
+
+/** @brief Free the rule table, called once all the IRQs are gone */
+static void ebbgpio_rules_free(void *unused){
+   kfree(rcu_dereference_protected(ruleTable, 1));
+   RCU_INIT_POINTER(ruleTable, NULL);
+}
+
+/** @brief Parse one rule: "<button> <trigger> <action> [<leds> [<ms>]]", e.g. "A press toggle 0-1"
+ *  or "B release pulse 1 250". leds is a list such as "0,2-3" and is needed by the LED actions. A
+ *  chord rule names two or more buttons joined by '+', e.g. "A+C chord pulse 0-1 500".
+ *  @param buf  the text of the rule
+ *  @param rule where the rule is returned
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_rule_parse(const char *buf, struct ebbgpio_rule *rule){
+   char names[2 * EBBGPIO_MAX_BUTTONS], trigger[16], action[16], leds[64], *p;
+   unsigned long chord = 0;
+   unsigned int ms = 0;
+   int n = sscanf(buf, " %51s %15s %15s %63s %u", names, trigger, action, leds, &ms);
+   int result, button;
+   if (n < 3) return -EINVAL;
+   for (p = names; ; p += 2){                // "A", or "A+C" for a chord
+      button = toupper(p[0]);
+      if (button < 'A' || button >= 'A' + numButtons) return -EINVAL;
+      __set_bit(button - 'A', &chord);
+      if (!p[1]) break;
+      if (p[1] != '+') return -EINVAL;
+   }
+   result = match_string(ebbgpio_trigger_names, ARRAY_SIZE(ebbgpio_trigger_names), trigger);
+   if (result < 0 || (result == EBBGPIO_TRIG_CHORD) != (hweight_long(chord) > 1)) return -EINVAL;
+   rule->trigger = result;
+   rule->button = __ffs(chord);
+   rule->chord = result == EBBGPIO_TRIG_CHORD ? chord : 0;
+   result = match_string(ebbgpio_action_names, ARRAY_SIZE(ebbgpio_action_names), action);
+   if (result <= EBBGPIO_ACTION_NONE) return -EINVAL;
+   rule->action = result;
+   rule->leds = 0;
+   rule->ms = ms;
+   if (rule->action <= EBBGPIO_ACTION_PULSE){   // The LED actions
+      if (n < 4) return -EINVAL;
+      result = bitmap_parselist(leds, &rule->leds, numLeds);
+      if (result) return result;
+      if (!rule->leds || (rule->action == EBBGPIO_ACTION_PULSE && !ms)) return -EINVAL;
+   }
+   return 0;
+}
+
+/** @brief Show the rule table, one rule per line in the format that rules_store() accepts */
+static ssize_t rules_show(struct class *class, struct class_attribute *attr, char *buf){
+   const struct ebbgpio_rules *rules;
+   unsigned int i;
+   ssize_t len = 0;
+   rcu_read_lock();
+   rules = rcu_dereference(ruleTable);
+   for (i = 0; i < rules->count; i++){
+      const struct ebbgpio_rule *r = &rules->rule[i];
+      unsigned long chord = r->chord ? r->chord : BIT(r->button);
+      unsigned int button;
+      for_each_set_bit(button, &chord, EBBGPIO_MAX_BUTTONS)
+         len += scnprintf(buf + len, PAGE_SIZE - len, "%s%c", button == r->button ? "" : "+", 'A' + button);
+      len += scnprintf(buf + len, PAGE_SIZE - len, " %s %s",
+                       ebbgpio_trigger_names[r->trigger], ebbgpio_action_names[r->action]);
+      if (r->leds) len += scnprintf(buf + len, PAGE_SIZE - len, " %*pbl", numLeds, &r->leds);
+      if (r->action == EBBGPIO_ACTION_PULSE) len += scnprintf(buf + len, PAGE_SIZE - len, " %u", r->ms);
+      len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+   }
+   rcu_read_unlock();
+   return len;
+}
+
+/** @brief Change the rule table. Writing a rule appends it, "del <n>" removes the rule on line n
+ *  (counting from 0) and "clear" removes them all, e.g. echo "A press pulse 0 100" > rules
+ */
+static ssize_t rules_store(struct class *class, struct class_attribute *attr, const char *buf, size_t count){
+   struct ebbgpio_rules *old, *rules;
+   struct ebbgpio_rule rule;
+   unsigned int del;
+   int result = 0;
+   mutex_lock(&ruleLock);
+   old = rcu_dereference_protected(ruleTable, lockdep_is_held(&ruleLock));
+   if (sysfs_streq(buf, "clear")){
+      rules = ebbgpio_rules_alloc(0);
+   } else if (sscanf(buf, "del %u", &del) == 1){
+      if (del >= old->count){
+         result = -EINVAL;
+         goto out;
+      }
+      rules = ebbgpio_rules_alloc(old->count - 1);
+      if (rules){
+         memcpy(rules->rule, old->rule, del * sizeof(rule));
+         memcpy(rules->rule + del, old->rule + del + 1, (old->count - del - 1) * sizeof(rule));
+         rules->count = old->count - 1;
+      }
+   } else {
+      result = ebbgpio_rule_parse(buf, &rule);
+      if (!result && old->count >= EBBGPIO_MAX_RULES) result = -ENOSPC;
+      if (result) goto out;
+      rules = ebbgpio_rules_alloc(old->count + 1);
+      if (rules){
+         memcpy(rules->rule, old->rule, old->count * sizeof(rule));
+         rules->rule[old->count] = rule;
+         rules->count = old->count + 1;
+      }
+   }
+   if (rules) ebbgpio_rules_publish(rules);
+   else result = -ENOMEM;
+out:
+   mutex_unlock(&ruleLock);
+   return result ? result : count;
+}
+static CLASS_ATTR_RW(rules);
+
+/** @brief Show /sys/class/ebbgpio/stats: a header line, then a line of counters per button
+ *  Each line is a consistent snapshot of the button (see ebbgpio_snapshot()), so one read replaces
+ *  scraping the attributes of every button. The max_* columns are the worst latencies in ns. The
+ *  drops column is the ring overrun count (ring_ctrl.dropped), the same on every line: an overrun
+ *  loses the events of whichever buttons were in the overwritten slots.
+ */
+static ssize_t stats_show(struct class *class, struct class_attribute *attr, char *buf){
+   struct ebbgpio_snapshot snap;
+   u32 drops = READ_ONCE(eventRing.ctrl->dropped);
+   int len, i, j;
+   len = scnprintf(buf, PAGE_SIZE, "button");
+   for (j = 0; j < EBBGPIO_STATS; j++) len += scnprintf(buf + len, PAGE_SIZE - len, " %s", ebbgpio_stat_names[j]);
+   len += scnprintf(buf + len, PAGE_SIZE - len, " drops");
+   for (j = 0; j < EBBGPIO_LAT_STAGES; j++) len += scnprintf(buf + len, PAGE_SIZE - len, " max_%s", ebbgpio_lat_names[j]);
+   len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+   for (i = 0; i < numButtons; i++){
+      if (!buttons[i].stats) continue;       // Never brought up
+      ebbgpio_snapshot(&buttons[i], &snap);
+      len += scnprintf(buf + len, PAGE_SIZE - len, "%c", 'A' + i);
+      for (j = 0; j < EBBGPIO_STATS; j++) len += scnprintf(buf + len, PAGE_SIZE - len, " %llu", snap.count[j]);
+      len += scnprintf(buf + len, PAGE_SIZE - len, " %u", drops);
+      for (j = 0; j < EBBGPIO_LAT_STAGES; j++) len += scnprintf(buf + len, PAGE_SIZE - len, " %llu", snap.maxLatency[j]);
+      len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+   }
+   return len;
+}
+static CLASS_ATTR_RO(stats);
+
+/** @brief Print one latency histogram of a button, summed over the CPUs. Empty buckets are skipped
+ *  @param m     the seq_file of the debugfs file
+ *  @param b     the button
+ *  @param stage one of the EBBGPIO_LAT_* stages
+ */
+static void ebbgpio_hist_show(struct seq_file *m, struct ebbgpio_button *b, int stage){
+   unsigned int i;
+   int cpu;
+   for (i = 0; i < EBBGPIO_LAT_BUCKETS; i++){
+      u64 count = 0;
+      for_each_possible_cpu(cpu) count += per_cpu_ptr(b->stats, cpu)->latency[stage][i];
+      if (!count) continue;
+      if (i == EBBGPIO_LAT_BUCKETS - 1)
+         seq_printf(m, "%10llu ns and up       : %llu\n", 1ULL << (i - 1), count);
+      else
+         seq_printf(m, "%10llu - %10llu ns: %llu\n", i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1, count);
+   }
+}
+
+static int ebbgpio_hist_irq_show(struct seq_file *m, void *unused){
+   ebbgpio_hist_show(m, m->private, EBBGPIO_LAT_IRQ);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ebbgpio_hist_irq);
+
+static int ebbgpio_hist_led_show(struct seq_file *m, void *unused){
+   ebbgpio_hist_show(m, m->private, EBBGPIO_LAT_LED);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ebbgpio_hist_led);
+
+static int ebbgpio_hist_dispatch_show(struct seq_file *m, void *unused){
+   ebbgpio_hist_show(m, m->private, EBBGPIO_LAT_DISPATCH);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ebbgpio_hist_dispatch);
+
+static int ebbgpio_hist_read_show(struct seq_file *m, void *unused){
+   ebbgpio_hist_show(m, m->private, EBBGPIO_LAT_READ);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ebbgpio_hist_read);
+
+static const struct file_operations *const ebbgpio_hist_fops[EBBGPIO_LAT_STAGES] = {
+   &ebbgpio_hist_irq_fops, &ebbgpio_hist_led_fops, &ebbgpio_hist_dispatch_fops, &ebbgpio_hist_read_fops,
+};
+
+/** @brief Clear the latency histograms of every button */
+static void ebbgpio_hist_clear(void){
+   int i, cpu;
+   for (i = 0; i < numButtons; i++)
+      for_each_possible_cpu(cpu)
+         if (buttons[i].stats)
+            memset(per_cpu_ptr(buttons[i].stats, cpu)->latency, 0, sizeof(buttons[i].stats->latency));
+}
+
+/** @brief Find a latency percentile of all the buttons together
+ *  @param stage    one of the EBBGPIO_LAT_* stages
+ *  @param permille the percentile in tenths of a percent, e.g. 999 for p99.9
+ *  @return returns the upper bound of the histogram bucket holding the percentile in ns, 0 if empty
+ */
+static u64 ebbgpio_hist_percentile(int stage, unsigned int permille){
+   u64 counts[EBBGPIO_LAT_BUCKETS] = {0};
+   u64 total = 0, sum = 0;
+   unsigned int i;
+   int j, cpu;
+   for (j = 0; j < numButtons; j++)
+      for_each_possible_cpu(cpu)
+         for (i = 0; i < EBBGPIO_LAT_BUCKETS && buttons[j].stats; i++)
+            counts[i] += per_cpu_ptr(buttons[j].stats, cpu)->latency[stage][i];
+   for (i = 0; i < EBBGPIO_LAT_BUCKETS; i++) total += counts[i];
+   for (i = 0; i < EBBGPIO_LAT_BUCKETS && total; i++){
+      sum += counts[i];
+      if (sum * 1000 >= total * permille) return (1ULL << i) - 1;
+   }
+   return 0;
+}
+
+/** @brief Writing anything to <debugfs>/ebbgpio/reset clears the histograms of every button */
+static ssize_t ebbgpio_hist_reset(struct file *filep, const char __user *buffer, size_t len, loff_t *offset){
+   ebbgpio_hist_clear();
+   return len;
+}
+
+static const struct file_operations ebbgpio_reset_fops = {
+   .owner = THIS_MODULE,
+   .open  = simple_open,
+   .write = ebbgpio_hist_reset,
+};
+
+/** @brief Create <debugfs>/ebbgpio and its reset file, the buttons add their own directories */
+static void ebbgpio_debugfs_init(void){
+   ebbgpioDebugfs = debugfs_create_dir("ebbgpio", NULL);
+   debugfs_create_file("reset", S_IWUSR, ebbgpioDebugfs, NULL, &ebbgpio_reset_fops);
+}
+
+/** @brief Create the latency histogram files of a button: irq, led, dispatch and read
+ *  @param b the button, its counters must already be allocated
+ */
+static void ebbgpio_debugfs_button(struct ebbgpio_button *b){
+   char name[8];
+   int stage;
+   snprintf(name, sizeof(name), "button%c", 'A' + b->index);
+   b->debugfs = debugfs_create_dir(name, ebbgpioDebugfs);
+   for (stage = 0; stage < EBBGPIO_LAT_STAGES; stage++)
+      debugfs_create_file(ebbgpio_lat_names[stage], S_IRUGO, b->debugfs, b, ebbgpio_hist_fops[stage]);
+}
+
+/** @brief Bring up one button: the GPIO, the debouncing and the IRQ. The counters of the button are
+ *  allocated the first time and kept until the device goes away, so they survive a rebind.
+ *  Called under configLock, ebbgpio_button_down() undoes it.
+ *  @param dev the ebbgpio device
+ *  @param b   the button, its index is set
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_button_up(struct device *dev, struct ebbgpio_button *b){
+   unsigned int i = b->index;
+   const char *script = b->cfg && b->cfg->script[0] ? b->cfg->script : buttonScripts[i];
+   int result, cpu;
+   if (b->up) return 0;
+   b->gpio = buttonGpios[i];
+   if (script && script[0]) b->argv[0] = kstrdup(script, GFP_KERNEL);
+   else b->argv[0] = kasprintf(GFP_KERNEL, "/usr/bin/buttonScripts/button%c.sh", 'A' + i);
+   if (!b->argv[0]) return -ENOMEM;
+   b->argv[1] = dispatchPolicy == EBBGPIO_POLICY_COALESCE ? b->dispatch.count : NULL;
+   INIT_WORK(&b->dispatch.work, ebbgpio_dispatch_work);
+   raw_spin_lock_init(&b->dispatch.lock);
+   raw_spin_lock_init(&b->edgeLock);
+   b->dispatch.envp[0] = "HOME=/";
+   b->dispatch.envp[1] = b->dispatch.envTime;
+   b->dispatch.envp[2] = b->dispatch.envSeq;
+   b->dispatch.envp[3] = NULL;
+   if (!b->stats){
+      b->stats = devm_alloc_percpu(dev, struct ebbgpio_stats);
+      if (!b->stats){
+         result = -ENOMEM;
+         goto err_script;
+      }
+      for_each_possible_cpu(cpu) seqcount_init(&per_cpu_ptr(b->stats, cpu)->seq);
+   }
+   // The counters can be read live, e.g. cat /sys/class/ebbgpio/buttonA/presses
+   b->dev = device_create_with_groups(ebbgpioClass, dev, MKDEV(0, 0), b, ebbgpio_button_groups,
+                                      "button%c", 'A' + i);
+   if (IS_ERR(b->dev)){
+      result = PTR_ERR(b->dev);
+      goto err_script;
+   }
+
+   if (!bench){                              // A simulated button has no GPIO
+      b->desc = ebbgpio_gpio_get(dev, "button", i, b->gpio, b->fw, GPIOD_IN);
+      if (IS_ERR(b->desc)){
+         result = PTR_ERR(b->desc);
+         goto err_dev;
+      }
+      b->gpio = desc_to_gpio(b->desc);
+      gpiod_direction_input(b->desc);        // Set the button GPIO to be an input
+   }
+   ebbgpio_bank_set(b, true);                // Sampled with the others from now on
+   ebbgpio_debounce_setup(b);                // Debounce the button, in software if the h/w can't
+   b->releases = bothEdges || b->debounce.soft;
+   ebbgpio_gesture_setup(b);
+   // GPIO numbers and IRQ numbers are not the same! This function performs the mapping for us
+   result = bench ? ebbgpio_bench_irq(b) : gpiod_to_irq(b->desc);
+   if (result < 0) goto err_gpio;
+   b->irq = result;
+   printk(KERN_INFO "GPIO_TEST: The button %c is GPIO %u on IRQ %d, its state is currently: %d\n",
+          'A' + i, b->gpio, b->irq, ebbgpio_level(b));
+
+   // This next call requests an interrupt line. With threaded=1 the top half only timestamps the
+   // edge and sets the LED, the rest of the work is done by a per-IRQ kernel thread.
+   result = request_threaded_irq(b->irq,     // The interrupt number requested
+                        (irq_handler_t) ebbgpio_irq_handler, // The pointer to the handler function below
+                        threaded ? (irq_handler_t) ebbgpio_irq_thread : NULL, // The bottom half, if any
+                        IRQF_TRIGGER_RISING | (bothEdges ? IRQF_TRIGGER_FALLING : 0),   // Press, and release
+                        "ebb_gpio_handler",    // Used in /proc/interrupts to identify the owner
+                        b);                    // The *dev_id tells the shared handler which button fired
+   if (result) goto err_gpio;
+   mutex_lock(&affinityLock);
+   b->affine = true;
+   result = ebbgpio_irq_affinity(b);
+   mutex_unlock(&affinityLock);
+   if (result)                               // Not fatal, the IRQ works on any CPU
+      printk(KERN_INFO "GPIO_TEST: failed to set the affinity of button %c: %d\n", 'A' + i, result);
+   ebbgpio_debugfs_button(b);
+   if (i >= numButtons) numButtons = i + 1;  // The rules may name it from now on
+   b->up = true;
+   return 0;
+
+err_gpio:
+   ebbgpio_bank_set(b, false);
+   if (!bench) ebbgpio_gpio_put(b->desc, b->fw);
+err_dev:
+   device_unregister(b->dev);
+err_script:
+   kfree(b->argv[0]);
+   return result;
+}
+
+/** @brief Release everything ebbgpio_button_up() acquired for a button, except its counters
+ *  The other buttons keep running. Called under configLock.
+ *  @param b the button
+ */
+static void ebbgpio_button_down(struct ebbgpio_button *b){
+   struct ebbgpio_snapshot snap;
+   bool polling;
+   if (!b->up) return;
+   ebbgpio_snapshot(b, &snap);
+   printk(KERN_INFO "Button %c has been pressed %llu times, %llu glitches were rejected.\n",
+          'A' + b->index, snap.count[EBBGPIO_STAT_PRESSES], snap.count[EBBGPIO_STAT_REJECTS]);
+   debugfs_remove_recursive(b->debugfs);     // Before the counters behind the files are freed
+   b->debugfs = NULL;
+   disable_irq(b->irq);                      // Stop new edges, then stop the debounce timer using the IRQ
+   polling = xchg(&b->storm.polling, false);
+   hrtimer_cancel(&pollTimer);               // A poll of the button may be running, wait for it
+   if (polling){
+      atomic_dec(&pollingButtons);
+      enable_irq(b->irq);                    // Undo the disable of the storm detector
+   }
+   if (atomic_read(&pollingButtons))         // Keep polling the other buttons
+      hrtimer_start(&pollTimer, ms_to_ktime(pollMs), HRTIMER_MODE_REL_HARD);
+   hrtimer_cancel(&b->debounce.timer);
+   hrtimer_cancel(&b->gesture.timer);        // After the debounce timer, which can start it
+   mutex_lock(&affinityLock);
+   b->affine = false;
+   irq_set_affinity_hint(b->irq, NULL);      // free_irq() insists on it
+   mutex_unlock(&affinityLock);
+   free_irq(b->irq, b);                      // Free the IRQ number, the *dev_id identifies our handler
+   cancel_work_sync(&b->dispatch.work);      // Nothing can queue it any more, waits for a running script
+   if (b->down) ebbgpio_input_key(b, false, ktime_get());   // No key stays down on the input device
+   b->down = false;
+   ebbgpio_bank_set(b, false);               // No sample of another button can read the line any more
+   if (!bench) ebbgpio_gpio_put(b->desc, b->fw);   // Free the Button GPIO
+   device_unregister(b->dev);
+   kfree(b->argv[0]);
+   b->up = false;
+}
+
+/** @brief Count an IRQ of a button and switch the button to polling if it is part of a storm
+ *  @param b    the button
+ *  @param time the time of the edge
+ *  @return returns true if the button is now polled and the edge should be ignored
+ */
+static bool ebbgpio_storm_check(struct ebbgpio_button *b, ktime_t time){
+   struct ebbgpio_storm *st = &b->storm;
+   unsigned int limit = READ_ONCE(stormRate) * EBBGPIO_STORM_WINDOW_MS / MSEC_PER_SEC;
+   if (!limit) return false;
+   if (ktime_ms_delta(time, st->windowStart) >= EBBGPIO_STORM_WINDOW_MS){
+      st->windowStart = time;                // A new window
+      st->count = 0;
+   }
+   if (++st->count <= limit) return false;
+   disable_irq_nosync(b->irq);               // We are called from this IRQ
+   trace_ebbgpio_storm(b->index, true, st->count);
+   st->storms++;
+   st->polls = 0;
+   st->lastChange = time;
+   WRITE_ONCE(st->polling, true);
+   if (atomic_inc_return(&pollingButtons) == 1)   // The first polled button starts the timer
+      hrtimer_start(&pollTimer, ms_to_ktime(pollMs), HRTIMER_MODE_REL_HARD);
+   if (verbose)
+      printk_ratelimited(KERN_INFO "GPIO_TEST: IRQ storm on button %c, polling it\n", 'A' + b->index);
+   return true;
+}
+
+/** @brief Sample every button in polling mode. A sample that differs from the debounced state is a
+ *  press or a release; the sampling period is longer than any bounce, so it needs no debouncing.
+ *  A button that has been stable for quietMs gets its IRQ back.
+ *  @return HRTIMER_RESTART while any button is still polled
+ */
+static enum hrtimer_restart ebbgpio_poll_timer(struct hrtimer *timer){
+   ktime_t now = ktime_get();
+   int i;
+   for (i = 0; i < numButtons; i++){
+      struct ebbgpio_button *b = &buttons[i];
+      struct ebbgpio_storm *st = &b->storm;
+      unsigned long held;
+      int level;
+      if (!READ_ONCE(st->polling)) continue;
+      st->polls++;
+      held = ebbgpio_bank_sample();
+      level = !!(held & BIT(b->index));
+      if (level != b->down){
+         st->lastChange = now;
+         WRITE_ONCE(b->seq, b->seq + 1);     // A polled edge counts like one seen by the top half
+         if (level) ebbgpio_press(b, now, held);
+         else if (b->releases) ebbgpio_release(b, now, held);
+         else b->down = false;             // Rising edges only, there is no release to report
+         if (level || b->releases) ebbgpio_wake_thread(b);
+      }
+      else if (ktime_ms_delta(now, st->lastChange) >= READ_ONCE(quietMs) && xchg(&st->polling, false)){
+         trace_ebbgpio_storm(b->index, false, st->polls);
+         st->windowStart = now;              // Start counting afresh
+         st->count = 0;
+         atomic_dec(&pollingButtons);
+         enable_irq(b->irq);
+      }
+   }
+   if (!atomic_read(&pollingButtons)) return HRTIMER_NORESTART;
+   hrtimer_forward_now(timer, ms_to_ktime(pollMs));
+   return HRTIMER_RESTART;
+}
+
+/** @brief The GPIO IRQ Handler function (top half)
+ *  This function is the custom interrupt handler shared by all the buttons. The same interrupt
+ *  handler cannot be invoked concurrently for one button as the interrupt line is masked out until the
+ *  function is complete, but different buttons can be handled on different CPUs at the same time.
+ *  This function is static as it should not be invoked directly from outside of this file. It runs in
+ *  hard-IRQ context, so it only captures the time of the edge and sets the LED (or hands the edge to the
+ *  software debounce engine, which does so once the press is confirmed). Everything slow is left
+ *  to the thread function below, which is either woken (threaded=1) or called inline (threaded=0).
+ *  The event itself is queued here, as the ring is lock-free this is cheap and no edge is lost when
+ *  several edges arrive before the thread gets to run.
+ *  @param irq    the IRQ number that is associated with the GPIO -- useful for logging.
+ *  @param dev_id the struct ebbgpio_button of the button that caused the interrupt
+ *  @param regs   h/w specific register values -- only really ever used for debugging.
+ *  return returns IRQ_WAKE_THREAD or IRQ_HANDLED if successful -- should return IRQ_NONE otherwise.
+ */
+static irq_handler_t ebbgpio_irq_handler(unsigned int irq, void *dev_id, struct pt_regs *regs){
+   struct ebbgpio_button *b = dev_id;
+   unsigned long held, flags;
+   raw_spin_lock_irqsave(&b->edgeLock, flags);   // Not IRQF_ONESHOT, the thread may be reading the last edge
+   b->pressTime = ktime_get();               // Capture the edge time and number before doing anything else
+   WRITE_ONCE(b->seq, b->seq + 1);           // Only this IRQ writes it, the timers only while it is off
+   raw_spin_unlock_irqrestore(&b->edgeLock, flags);
+   trace_ebbgpio_irq(b->index, irq, b->pressTime, b->seq);
+   if (bench){                               // Time from the injection, see ebbgpio_bench_thread
+      this_cpu_inc(benchHandled);
+      ebbgpio_latency(b, EBBGPIO_LAT_IRQ, ktime_to_ns(ktime_sub(b->pressTime, READ_ONCE(b->simTime))));
+   }
+   if (ebbgpio_storm_check(b, b->pressTime)) return (irq_handler_t) IRQ_HANDLED;   // Polled from now on
+   held = ebbgpio_bank_sample();             // The one read of the lines for this edge, see bankHeld
+   if (ebbgpio_wake_edge(b, b->pressTime, held))   // The press that woke the system, already released
+      return threaded ? (irq_handler_t) IRQ_WAKE_THREAD : ebbgpio_irq_thread(irq, dev_id, regs);
+   if (ebbgpio_debounce_edge(b, b->pressTime, held)) return (irq_handler_t) IRQ_HANDLED;   // Confirmed later
+   if (!bothEdges) ebbgpio_press(b, b->pressTime, held);   // Every edge is a press, set the LED and queue the event
+   else if (!!(held & BIT(b->index)) == b->down){   // No change, the edge was lost in a bounce
+      ebbgpio_count(b, EBBGPIO_STAT_SPURIOUS);
+      return (irq_handler_t) IRQ_HANDLED;
+   }
+   else if (!b->down) ebbgpio_press(b, b->pressTime, held);
+   else ebbgpio_release(b, b->pressTime, held);
+   if (threaded) return (irq_handler_t) IRQ_WAKE_THREAD;   // Leave the rest to the IRQ thread
+   return ebbgpio_irq_thread(irq, dev_id, regs);
+}
+
+/** @brief Replay the press that woke the system, if the button was let go before the IRQ was delivered
+ *  The wake-up edge is held pending while the system resumes and is only handed to the top half
+ *  afterwards. By then a short press is over and the line is low, so the normal path would take
+ *  the edge as a glitch. The first edge of a button after a suspend has woken the system if it came
+ *  during the resume, so it becomes a press and a release.
+ *  @param b    the button
+ *  @param time the time of the edge
+ *  @param held the bank sample of the edge
+ *  @return returns true if the edge was replayed as a press
+ */
+static bool ebbgpio_wake_edge(struct ebbgpio_button *b, ktime_t time, unsigned long held){
+   if (likely(!READ_ONCE(b->wakeArmed)) || !xchg(&b->wakeArmed, false)) return false;
+   if (b->down || (held & BIT(b->index))) return false;   // Still held, a normal press
+   if (verbose) printk_ratelimited(KERN_INFO "GPIO_TEST: button %c woke the system up\n", 'A' + b->index);
+   ebbgpio_press(b, time, held);
+   if (b->releases) ebbgpio_release(b, time, held);
+   return true;
+}
+
+/** @brief Copy the time and number of the last edge of a button, outside of its top half
+ *  @param b   the button
+ *  @param seq set to the number of the edge, can be NULL
+ *  @return returns the time of the edge
+ */
+static ktime_t ebbgpio_edge(struct ebbgpio_button *b, u32 *seq){
+   unsigned long flags;
+   ktime_t time;
+   raw_spin_lock_irqsave(&b->edgeLock, flags);   // A u64 is not atomic on every CPU
+   time = b->pressTime;
+   if (seq) *seq = READ_ONCE(b->seq);   // The timers bump it too, while the IRQ is off
+   raw_spin_unlock_irqrestore(&b->edgeLock, flags);
+   return time;
+}
+
+/** @brief The GPIO IRQ thread function (bottom half)
+ *  Reads the button state, logs the press and hands the button script to the dispatch workqueue if a
+ *  script rule fired. With threaded=1 this runs
+ *  in the IRQ thread with interrupts enabled, so none of this work adds to the hard-IRQ latency of
+ *  other devices. The delay since the edge is traced so the scheduling latency of the thread shows up.
+ *  The log line is ratelimited, so a bouncing or stuck input can not flood a slow serial console.
+ *  Same parameters and return value as the top half.
+ */
+static irq_handler_t ebbgpio_irq_thread(unsigned int irq, void *dev_id, struct pt_regs *regs){
+   struct ebbgpio_button *b = dev_id;
+   int state = test_bit(b->index, &bankHeld);   // As last sampled, the log line is no reason for a read
+   s64 latency = ktime_to_ns(ktime_sub(ktime_get(), ebbgpio_edge(b, NULL)));
+   bool script = test_and_clear_bit(EBBGPIO_ACTION_SCRIPT, &b->deferred) && useHelper;
+   if (threaded) ebbgpio_tune_thread();
+   ebbgpio_latency(b, EBBGPIO_LAT_DISPATCH, latency);
+   trace_ebbgpio_dispatch(b->index, state, latency, script);
+   if (verbose)
+      printk_ratelimited(KERN_INFO "GPIO_TEST: Interrupt! (button %c state is %d, %lld us after the edge)\n",
+                         'A' + b->index, state, latency / NSEC_PER_USEC);
+   if (script) ebbgpio_dispatch(b);
+   return (irq_handler_t) IRQ_HANDLED;      // Announce that the IRQ has been handled correctly
+}
+
+/** @brief Request a run of the button script, following scriptPolicy. Safe in any context
+ *  @param b the button
+ */
+static void ebbgpio_dispatch(struct ebbgpio_button *b){
+   struct ebbgpio_dispatch *d = &b->dispatch;
+   unsigned long flags;
+   ktime_t time;
+   u32 seq;
+   bool queued;
+   switch (dispatchPolicy){
+   case EBBGPIO_POLICY_DROP:                 // Only if the script is neither queued nor running
+      queued = !atomic_read(&d->running) && atomic_cmpxchg(&d->pending, 0, 1) == 0;
+      break;
+   case EBBGPIO_POLICY_COALESCE:             // Folded into the next run, that is never dropped
+      atomic_inc(&d->pending);
+      queued = true;
+      break;
+   default:                                  // One run per press, up to scriptDepth waiting
+      queued = atomic_add_unless(&d->pending, 1, scriptDepth);
+      break;
+   }
+   if (!queued){
+      atomic_inc(&d->dropped);
+      return;
+   }
+   time = ebbgpio_edge(b, &seq);
+   raw_spin_lock_irqsave(&d->lock, flags);   // Raw, with threaded=0 this runs in hard-IRQ context
+   d->time = ebbgpio_timestamp(time);
+   d->seq = seq;
+   raw_spin_unlock_irqrestore(&d->lock, flags);
+   queue_work(dispatchWq, &d->work);         // Already queued is fine, the work empties pending
+}
+
+/** @brief Runs in the new process of a script before the exec, moves it to threadCpus
+ *  @return returns 0, a failure to move the script is not a reason not to run it
+ */
+static int ebbgpio_script_init(struct subprocess_info *info, struct cred *new){
+   mutex_lock(&affinityLock);
+   if (!cpumask_empty(&threadCpuMask)) set_cpus_allowed_ptr(current, &threadCpuMask);
+   mutex_unlock(&affinityLock);
+   return 0;
+}
+
+/** @brief The dispatch work of a button: run its script until no run is pending, waiting for each
+ *  one to exit so that the concurrency cap of the workqueue is also a cap on the running scripts.
+ *  With scriptPolicy=coalesce each run gets the number of presses it stands for as its argument.
+ *  EBBGPIO_TIME (ns, in the clock= clock) and EBBGPIO_SEQ in the environment are those of the latest
+ *  press handed to the dispatcher, so a script can tell how long it waited for its turn.
+ *  @param work the work of the button
+ */
+static void ebbgpio_dispatch_work(struct work_struct *work){
+   struct ebbgpio_dispatch *d = container_of(work, struct ebbgpio_dispatch, work);
+   struct ebbgpio_button *b = container_of(d, struct ebbgpio_button, dispatch);
+   struct subprocess_info *info;
+   int count;
+   for (;;){
+      atomic_set(&d->running, 1);            // Before pending drops, so scriptPolicy=drop sees the run
+      if (dispatchPolicy == EBBGPIO_POLICY_COALESCE) count = atomic_xchg(&d->pending, 0);
+      else count = atomic_dec_if_positive(&d->pending) >= 0;
+      if (!count) break;
+      snprintf(d->count, sizeof(d->count), "%d", count);
+      raw_spin_lock_irq(&d->lock);
+      snprintf(d->envTime, sizeof(d->envTime), "EBBGPIO_TIME=%llu", d->time);
+      snprintf(d->envSeq, sizeof(d->envSeq), "EBBGPIO_SEQ=%u", d->seq);
+      raw_spin_unlock_irq(&d->lock);
+      info = call_usermodehelper_setup(b->argv[0], b->argv, d->envp, GFP_KERNEL, ebbgpio_script_init, NULL, NULL);
+      ebbgpio_count(b, EBBGPIO_STAT_LAUNCHES);
+      if (!info || call_usermodehelper_exec(info, UMH_WAIT_PROC))   // Could not run, or exited non-zero
+         ebbgpio_count(b, EBBGPIO_STAT_FAILURES);
+   }
+   atomic_set(&d->running, 0);
+}
+
+/** @brief The open function of /dev/ebbgpio, gives the file its own position at the newest event */
+static int ebbgpio_dev_open(struct inode *inodep, struct file *filep){
+   struct ebbgpio_reader *r = kzalloc(sizeof(*r), GFP_KERNEL);
+   if (!r) return -ENOMEM;
+   mutex_init(&r->lock);
+   r->pos = READ_ONCE(eventRing.ctrl->head);
+   filep->private_data = r;
+   return 0;
+}
+
+/** @brief The read function of /dev/ebbgpio
+ *  Blocks until at least one event is queued (unless the file was opened with O_NONBLOCK) and then
+ *  copies as many whole struct ebbgpio_event records as fit into the user buffer. If the file was
+ *  overrun an EBBGPIO_EVENT_OVERRUN record takes the place of the lost events.
+ *  @param filep  the open file
+ *  @param buffer the user-space buffer, it must hold at least one record
+ *  @param len    the length of the buffer in bytes
+ *  @param offset unused, the position is kept in the reader of the file
+ *  @return returns the number of bytes copied or a negative error code
+ */
+static ssize_t ebbgpio_dev_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset){
+   struct ebbgpio_reader *r = filep->private_data;
+   struct ebbgpio_event ev;
+   size_t copied = 0;
+   int ret = 0;
+   if (len < sizeof(struct ebbgpio_event)) return -EINVAL;
+   do {
+      if (!ebbgpio_reader_ready(r)){
+         if (filep->f_flags & O_NONBLOCK) return -EAGAIN;
+         ret = wait_event_interruptible(eventWait, ebbgpio_reader_ready(r));
+         if (ret) return ret;
+      }
+      if (mutex_lock_interruptible(&r->lock)) return -ERESTARTSYS;
+      while (copied + sizeof(struct ebbgpio_event) <= len && ebbgpio_reader_take(r, &ev)){
+         if (copy_to_user(buffer + copied, &ev, sizeof(ev))){
+            ret = -EFAULT;
+            break;
+         }
+         if (ev.edge != EBBGPIO_EVENT_OVERRUN && ev.button < numButtons)   // How long it waited for the consumer
+            ebbgpio_latency(&buttons[ev.button], EBBGPIO_LAT_READ, ebbgpio_timestamp(ktime_get()) - ev.timestamp);
+         copied += sizeof(ev);
+      }
+      mutex_unlock(&r->lock);
+   } while (!ret && !copied);                  // Another reader of the file took the events first, wait again
+   return copied ? copied : ret;
+}
+
+/** @brief The poll function of /dev/ebbgpio, readable whenever an event is queued at the file position */
+static __poll_t ebbgpio_dev_poll(struct file *filep, poll_table *wait){
+   poll_wait(filep, &eventWait, wait);
+   smp_mb();                                 // Queued before the check, pairs with wq_has_sleeper() in push
+   return ebbgpio_reader_ready(filep->private_data) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/** @brief The llseek function of /dev/ebbgpio, moves the position of the file in the ring. An mmap
+ *  consumer sets it to its own position before blocking in poll(), see ebbgpio.h.
+ *  @param filep  the open file
+ *  @param offset the ring position (SEEK_SET) or a distance from the file or ring position
+ *  @param whence SEEK_SET, SEEK_CUR or SEEK_END (the head of the ring)
+ *  @return returns the new position or a negative error code
+ */
+static loff_t ebbgpio_dev_llseek(struct file *filep, loff_t offset, int whence){
+   struct ebbgpio_reader *r = filep->private_data;
+   u32 pos;
+   mutex_lock(&r->lock);
+   switch (whence){
+   case SEEK_SET: pos = offset; break;
+   case SEEK_CUR: pos = r->pos + offset; break;
+   case SEEK_END: pos = READ_ONCE(eventRing.ctrl->head) + offset; break;
+   default:
+      mutex_unlock(&r->lock);
+      return -EINVAL;
+   }
+   r->pos = pos;
+   r->lost = 0;
+   mutex_unlock(&r->lock);
+   return pos;
+}
+
+/** @brief The mmap function of /dev/ebbgpio
+ *  Maps the control page and the slots of the event ring (see ebbgpio.h) into the caller, so a
+ *  consumer can take events without a read() call or a copy. The mapping must start at offset 0 and
+ *  is read-only: the ring is shared by every reader, and the kernel trusts head and the slot seqs.
+ *  @param filep the open file
+ *  @param vma   the user-space area to map the ring into
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_dev_mmap(struct file *filep, struct vm_area_struct *vma){
+   if (vma->vm_pgoff) return -EINVAL;
+   if (vma->vm_flags & VM_WRITE) return -EPERM;
+   vma->vm_flags &= ~VM_MAYWRITE;            // Nor can mprotect() make it writable later
+   return remap_vmalloc_range(vma, eventRing.ctrl, 0);   // Fails if the area is bigger than the ring
+}
+
+/** @brief The fasync function of /dev/ebbgpio, (un)registers the file for SIGIO */
+static int ebbgpio_dev_fasync(int fd, struct file *filep, int on){
+   return fasync_helper(fd, filep, on, &eventAsync);
+}
+
+/** @brief The release function of /dev/ebbgpio, drops the file from the SIGIO list and frees its reader */
+static int ebbgpio_dev_release(struct inode *inodep, struct file *filep){
+   ebbgpio_dev_fasync(-1, filep, 0);
+   kfree(filep->private_data);
+   return 0;
+}
+
+static const struct file_operations ebbgpio_fops = {
+   .owner   = THIS_MODULE,
+   .open    = ebbgpio_dev_open,
+   .read    = ebbgpio_dev_read,
+   .poll    = ebbgpio_dev_poll,
+   .mmap    = ebbgpio_dev_mmap,
+   .fasync  = ebbgpio_dev_fasync,
+   .release = ebbgpio_dev_release,
+   .llseek  = ebbgpio_dev_llseek,
+};
+
+static struct miscdevice ebbgpio_miscdev = {
+   .minor = MISC_DYNAMIC_MINOR,
+   .name  = "ebbgpio",                       // Appears as /dev/ebbgpio
+   .fops  = &ebbgpio_fops,
+};
+
+/** @brief Register the /dev/ebbgpio misc device
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_dev_register(void){
+   int result = ebbgpio_ring_init();
+   if (result) return result;
+   result = misc_register(&ebbgpio_miscdev);
+   if (result){
+      printk(KERN_INFO "GPIO_TEST: failed to register /dev/ebbgpio: %d\n", result);
+      ebbgpio_ring_free();
+   }
+   return result;
+}
+
+/** @brief Remove the /dev/ebbgpio misc device */
+static void ebbgpio_dev_deregister(void *unused){
+   printk(KERN_INFO "GPIO_TEST: %u events were overrun before a reader took them\n", eventRing.ctrl->dropped);
+   misc_deregister(&ebbgpio_miscdev);
+   ebbgpio_ring_free();                      // The device pins the module while it is open or mapped
+}
+
+/** @brief Send the events queued since the last batch to the netlink group
+ *  @param work genlWork
+ */
+static void ebbgpio_genl_work(struct work_struct *work){
+   struct sk_buff *skb;
+   void *hdr;
+   unsigned int n;
+   int result;
+   mutex_lock(&genlReader.lock);
+   if (xchg(&genlRestart, false)){           // New listeners start from the event that scheduled the work
+      genlReader.pos = READ_ONCE(genlStart);
+      genlReader.lost = 0;
+   }
+   do {
+      n = 0;
+      while (n < EBBGPIO_GENL_BATCH && ebbgpio_reader_take(&genlReader, &genlBatch[n])) n++;
+      if (!n || !genl_has_listeners(&ebbgpio_genl_family, &init_net, 0)) break;   // Nobody is left to tell
+      skb = genlmsg_new(nla_total_size(n * sizeof(genlBatch[0])) + nla_total_size(sizeof(u32)), GFP_KERNEL);
+      if (!skb) break;
+      hdr = genlmsg_put(skb, 0, 0, &ebbgpio_genl_family, 0, EBBGPIO_CMD_EVENTS);
+      if (!hdr || nla_put(skb, EBBGPIO_ATTR_EVENTS, n * sizeof(genlBatch[0]), genlBatch) ||
+          nla_put_u32(skb, EBBGPIO_ATTR_CLOCK, eventRing.ctrl->clock)){
+         nlmsg_free(skb);
+         break;
+      }
+      genlmsg_end(skb, hdr);
+      result = genlmsg_multicast(&ebbgpio_genl_family, skb, 0, 0, GFP_KERNEL);
+      if (result && result != -ESRCH)        // -ESRCH is no listener, they may just have left
+         printk_ratelimited(KERN_INFO "GPIO_TEST: failed to send %u events to netlink: %d\n", n, result);
+   } while (n == EBBGPIO_GENL_BATCH);        // A full batch, there may be more
+   mutex_unlock(&genlReader.lock);
+}
+
+static const struct genl_multicast_group ebbgpio_genl_groups[] = {
+   { .name = EBBGPIO_GENL_MCGRP, },
+};
+
+static struct genl_family ebbgpio_genl_family = {
+   .name       = EBBGPIO_GENL_NAME,
+   .version    = EBBGPIO_GENL_VERSION,
+   .maxattr    = EBBGPIO_ATTR_MAX,
+   .module     = THIS_MODULE,
+   .mcgrps     = ebbgpio_genl_groups,
+   .n_mcgrps   = ARRAY_SIZE(ebbgpio_genl_groups),
+};
+
+/** @brief Register the generic netlink family, unless netlinkMs=0. Called once the ring is up
+ *  @return returns 0 if successful
+ */
+static int ebbgpio_genl_register(void){
+   int result;
+   if (!netlinkMs) return 0;
+   mutex_init(&genlReader.lock);
+   genlReader.pos = READ_ONCE(eventRing.ctrl->head);
+   genlReader.lost = 0;
+   genlIdle = false;
+   genlRestart = false;
+   result = genl_register_family(&ebbgpio_genl_family);
+   if (result){
+      printk(KERN_INFO "GPIO_TEST: failed to register the netlink family: %d\n", result);
+      return result;
+   }
+   WRITE_ONCE(genlReady, true);
+   return 0;
+}
+
+/** @brief Unregister the generic netlink family, before the ring goes away */
+static void ebbgpio_genl_unregister(void *unused){
+   if (!genlReady) return;
+   WRITE_ONCE(genlReady, false);             // No new batch, the buttons are down already (devm order)
+   synchronize_rcu();                        // The pushes run with preemption off, any that saw genlReady is done
+   cancel_delayed_work_sync(&genlWork);
+   genl_unregister_family(&ebbgpio_genl_family);
+}
+
+/** @brief Sum the edges handled by the top half on all the CPUs */
+static u64 ebbgpio_bench_handled(void){
+   u64 sum = 0;
+   int cpu;
+   for_each_possible_cpu(cpu) sum += per_cpu(benchHandled, cpu);
+   return sum;
+}
+
+/** @brief Show the results of the benchmark so far in <debugfs>/ebbgpio/bench */
+static int ebbgpio_bench_show(struct seq_file *m, void *unused){
+   static const unsigned int pct[] = {500, 900, 990, 999};
+   ktime_t elapsed = READ_ONCE(benchRun.elapsed);
+   u64 injected = READ_ONCE(benchRun.injected), handled = ebbgpio_bench_handled(), ns, rate = 0;
+   unsigned int scripts = 0, storms = 0;
+   int i, stage;
+   if (!elapsed) elapsed = ktime_sub(ktime_get(), benchRun.start);   // Still running
+   ns = ktime_to_ns(elapsed);
+   if (ns) rate = div64_u64(handled * NSEC_PER_SEC, ns);
+   for (i = 0; i < numButtons; i++){
+      scripts += atomic_read(&buttons[i].dispatch.dropped);
+      storms += READ_ONCE(buttons[i].storm.storms);
+   }
+   seq_printf(m, "state      %s\n", READ_ONCE(benchRun.elapsed) ? "done" : "running");
+   seq_printf(m, "injected   %llu\n", injected);
+   seq_printf(m, "handled    %llu\n", handled);
+   seq_printf(m, "coalesced  %llu\n", injected > handled ? injected - handled : 0);
+   seq_printf(m, "elapsed_us %llu\n", div_u64(ns, NSEC_PER_USEC));
+   seq_printf(m, "edges/s    %llu\n", rate);
+   seq_printf(m, "ring_overruns %u\n", READ_ONCE(eventRing.ctrl->dropped) - benchRun.dropped);
+   seq_printf(m, "script_drops %u\n", scripts);
+   seq_printf(m, "storms     %u\n", storms);
+   seq_puts(m, "stage      p50_ns p90_ns p99_ns p99.9_ns\n");
+   for (stage = 0; stage < EBBGPIO_LAT_STAGES; stage++){
+      seq_printf(m, "%-10s", ebbgpio_lat_names[stage]);
+      for (i = 0; i < ARRAY_SIZE(pct); i++) seq_printf(m, " %llu", ebbgpio_hist_percentile(stage, pct[i]));
+      seq_putc(m, '\n');
+   }
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ebbgpio_bench);
+
+/** @brief Show the report of the stress run so far in <debugfs>/ebbgpio/stress */
+static int ebbgpio_stress_show(struct seq_file *m, void *unused){
+   unsigned int phase = READ_ONCE(stressRun.phase), i;
+   seq_printf(m, "state          %s\n", phase < EBBGPIO_STRESS_PHASES ? ebbgpio_stress_names[phase] : "done");
+   seq_puts(m, "phase          injected stalls\n");
+   for (i = 0; i < EBBGPIO_STRESS_PHASES; i++)
+      seq_printf(m, "%-14s %llu %u\n", ebbgpio_stress_names[i], READ_ONCE(stressRun.injected[i]), stressRun.stalls[i]);
+   seq_printf(m, "storms         %u, %u in bounce\n", stressRun.storms, stressRun.bounceStorms);
+   seq_printf(m, "max_pending    %d\n", stressRun.maxPending);
+   seq_printf(m, "stalled_reader %u queued, %u kept, %u lost\n", stressRun.stallQueued, stressRun.stallKept,
+              stressRun.stallLost);
+   seq_printf(m, "mem_delta_kb   %ld\n", stressRun.memDelta);
+   seq_printf(m, "failures       %u\n", stressRun.failures);
+   return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ebbgpio_stress);
+
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+static struct irq_domain *benchDomain;    ///< One simulated IRQ per button
+
+/** @brief Inject one edge on the simulated line of a button, from any of the injector kthreads
+ *  @param b     the button
+ *  @param level the new level of the line
+ */
+static void ebbgpio_bench_edge(struct ebbgpio_button *b, int level){
+   WRITE_ONCE(b->simLevel, level);
+   WRITE_ONCE(b->simTime, ktime_get());
+   irq_set_irqchip_state(b->irq, IRQCHIP_STATE_PENDING, true);
+}
+
+/** @brief Sleep in an injector kthread until it is stopped */
+static void ebbgpio_bench_park(void){
+   while (!kthread_should_stop()){           // Wait for the module to be removed
+      set_current_state(TASK_INTERRUPTIBLE);
+      if (!kthread_should_stop()) schedule();
+      __set_current_state(TASK_RUNNING);
+   }
+}
+
+/** @brief The injector kthread, see benchRun above
+ *  @param unused not used
+ *  @return returns 0 once stopped
+ */
+static int ebbgpio_bench_thread(void *unused){
+   u64 n, period = benchRate ? div_u64(NSEC_PER_SEC, benchRate) : 0;
+   ktime_t next;
+   ebbgpio_hist_clear();                     // Only this run in the percentiles
+   benchRun.dropped = READ_ONCE(eventRing.ctrl->dropped);
+   benchRun.start = next = ktime_get();
+   for (n = 0; n < benchEdges && !kthread_should_stop(); n++){
+      struct ebbgpio_button *b = &buttons[n % numButtons];
+      ebbgpio_bench_edge(b, bothEdges ? !b->simLevel : 1);   // Press, release, press, ...
+      WRITE_ONCE(benchRun.injected, n + 1);
+      if (period){
+         next = ktime_add_ns(next, period);
+         if (ktime_to_ns(ktime_sub(next, ktime_get())) > 50 * NSEC_PER_USEC){   // Worth sleeping
+            set_current_state(TASK_UNINTERRUPTIBLE);
+            schedule_hrtimeout(&next, HRTIMER_MODE_ABS);
+         }
+      }
+      if (!(n & 1023)) cond_resched();
+   }
+   WRITE_ONCE(benchRun.elapsed, ktime_sub(ktime_get(), benchRun.start));
+   printk(KERN_INFO "GPIO_TEST: bench: %llu edges injected, %llu handled in %lld us\n",
+          benchRun.injected, ebbgpio_bench_handled(), ktime_to_us(benchRun.elapsed));
+   ebbgpio_bench_park();
+   return 0;
+}
+
+/** @brief One injector of a stress phase */
+struct ebbgpio_stress_worker {
+   struct task_struct *task;
+   unsigned int phase;
+   u64 edges;                        ///< Edges to inject
+   u64 injected;                     ///< Edges injected so far, read by the harness
+};
+
+/** @brief An injector kthread of a stress phase, see stressRun above
+ *  @param data the struct ebbgpio_stress_worker of the kthread
+ *  @return returns 0 once stopped
+ */
+static int ebbgpio_stress_worker(void *data){
+   struct ebbgpio_stress_worker *w = data;
+   struct ebbgpio_button *b;
+   u64 n;
+   for (n = 0; n < w->edges && !kthread_should_stop(); n++){
+      switch (w->phase){
+      case EBBGPIO_STRESS_BOUNCE:            // Bursts of 32 edges on one button, as fast as possible
+         b = &buttons[(n / 32) % numButtons];
+         ebbgpio_bench_edge(b, !READ_ONCE(b->simLevel));
+         if (n % 32 == 31) usleep_range(1000, 2000);
+         break;
+      case EBBGPIO_STRESS_STUCK:             // Button A stays pressed while the others are used
+         b = numButtons > 1 ? &buttons[1 + n % (numButtons - 1)] : &buttons[0];
+         ebbgpio_bench_edge(b, b->index ? !READ_ONCE(b->simLevel) : 1);
+         usleep_range(100, 300);
+         break;
+      default:                               // Round-robin over the buttons, flat out
+         b = &buttons[n % numButtons];
+         ebbgpio_bench_edge(b, !READ_ONCE(b->simLevel));
+         break;
+      }
+      WRITE_ONCE(w->injected, n + 1);
+      if (!(n & 1023)) cond_resched();
+   }
+   ebbgpio_bench_park();
+   return 0;
+}
+
+/** @brief The sum of the edges the buttons numbered, the progress of the pipeline including polling */
+static u64 ebbgpio_stress_edges(void){
+   u64 sum = ebbgpio_bench_handled();
+   int i;
+   for (i = 0; i < numButtons; i++) sum += READ_ONCE(buttons[i].seq);
+   return sum;
+}
+
+/** @brief The sum of the storms the buttons detected so far */
+static unsigned int ebbgpio_stress_storms(void){
+   unsigned int sum = 0;
+   int i;
+   for (i = 0; i < numButtons; i++) sum += READ_ONCE(buttons[i].storm.storms);
+   return sum;
+}
+
+/** @brief Run the injectors of one phase, one per CPU for all_cpus, and watch them until they are done
+ *  A second with neither an injected edge nor a handled one counts as a stall of the phase.
+ *  @param phase the phase
+ *  @param edges the edges of each injector
+ */
+static void ebbgpio_stress_phase(unsigned int phase, u64 edges){
+   struct ebbgpio_stress_worker *w;
+   u64 injected, progress, last = 0;
+   unsigned int count = 0, idle = 0, i;
+   bool done;
+   int cpu;
+   w = kcalloc(nr_cpu_ids, sizeof(*w), GFP_KERNEL);
+   if (!w){
+      stressRun.failures++;
+      return;
+   }
+   WRITE_ONCE(stressRun.phase, phase);
+   for_each_online_cpu(cpu){
+      w[count].phase = phase;
+      w[count].edges = edges;
+      w[count].task = kthread_create(ebbgpio_stress_worker, &w[count], "ebbgpio-stress/%d", cpu);
+      if (IS_ERR(w[count].task)) continue;
+      if (phase == EBBGPIO_STRESS_ALL) kthread_bind(w[count].task, cpu);
+      wake_up_process(w[count].task);
+      if (++count == 1 && phase != EBBGPIO_STRESS_ALL) break;   // The other phases have one injector
+   }
+   do {
+      schedule_timeout_interruptible(msecs_to_jiffies(100));
+      done = true;
+      injected = 0;
+      for (i = 0; i < count; i++){
+         injected += READ_ONCE(w[i].injected);
+         if (READ_ONCE(w[i].injected) < edges) done = false;
+      }
+      WRITE_ONCE(stressRun.injected[phase], injected);
+      for (i = 0; i < numButtons; i++)
+         stressRun.maxPending = max(stressRun.maxPending, atomic_read(&buttons[i].dispatch.pending));
+      progress = injected + ebbgpio_stress_edges();
+      if (progress != last) idle = 0;
+      else if (!done && ++idle == 10){
+         stressRun.stalls[phase]++;
+         idle = 0;
+         printk(KERN_INFO "GPIO_TEST: stress: no progress in the %s phase for 1 s\n", ebbgpio_stress_names[phase]);
+      }
+      last = progress;
+   } while (!done && !kthread_should_stop());
+   for (i = 0; i < count; i++) kthread_stop(w[i].task);
+   kfree(w);
+}
+
+/** @brief Let go of every simulated button and wait for the timers, the gestures and the polling to end */
+static void ebbgpio_stress_settle(void){
+   int i;
+   for (i = 0; i < numButtons; i++)
+      if (READ_ONCE(buttons[i].simLevel)) ebbgpio_bench_edge(&buttons[i], 0);
+   schedule_timeout_interruptible(msecs_to_jiffies(longMs + doubleMs + quietMs + 2 * pollMs + 100));
+}
+
+/** @brief Count a failed check of the stress run and say which one
+ *  @param what the check
+ */
+static void ebbgpio_stress_fail(const char *what){
+   stressRun.failures++;
+   printk(KERN_INFO "GPIO_TEST: stress: FAILED: %s\n", what);
+}
+
+/** @brief The stress harness kthread, see stressRun above
+ *  @param unused not used
+ *  @return returns 0 once stopped
+ */
+static int ebbgpio_stress_thread(void *unused){
+   u64 edges = max_t(u64, benchEdges / EBBGPIO_STRESS_PHASES, 4 * numButtons);
+   long mem = si_mem_available();
+   struct ebbgpio_snapshot snap;
+   struct ebbgpio_reader stalled;
+   struct ebbgpio_event ev;
+   unsigned int phase, storms;
+   u32 start = 0, end;
+   int i;
+   mutex_init(&stalled.lock);
+   stalled.pos = stalled.lost = 0;
+   ebbgpio_hist_clear();
+   benchRun.dropped = READ_ONCE(eventRing.ctrl->dropped);
+   benchRun.start = ktime_get();
+   for (phase = 0; phase < EBBGPIO_STRESS_PHASES && !kthread_should_stop(); phase++){
+      u64 phaseEdges = phase == EBBGPIO_STRESS_STUCK ? (2 * longMs + 1000) * 5 : edges;   // ~5 edges per ms
+      if (phase == EBBGPIO_STRESS_STALL){    // A reader that stops reading, for four rings or more
+         stalled.pos = start = READ_ONCE(eventRing.ctrl->head);
+         phaseEdges = max_t(u64, edges, 4 * (eventRing.mask + 1));
+      }
+      if (phase == EBBGPIO_STRESS_STUCK) ebbgpio_bench_edge(&buttons[0], 1);
+      storms = ebbgpio_stress_storms();
+      ebbgpio_stress_phase(phase, phaseEdges);
+      ebbgpio_stress_settle();
+      if (phase == EBBGPIO_STRESS_BOUNCE) stressRun.bounceStorms = ebbgpio_stress_storms() - storms;
+      if (phase == EBBGPIO_STRESS_STUCK && buttons[0].releases && READ_ONCE(buttons[0].down))
+         ebbgpio_stress_fail("button A is still down after its release");
+   }
+   if (phase == EBBGPIO_STRESS_PHASES && !kthread_should_stop()){   // Not stopped early, check the whole run
+      end = READ_ONCE(eventRing.ctrl->head);
+      mutex_lock(&stalled.lock);
+      while ((s32)(end - stalled.pos) > 0 && ebbgpio_reader_take(&stalled, &ev)){
+         if (ev.edge == EBBGPIO_EVENT_OVERRUN) stressRun.stallLost += ev.duration;
+         else stressRun.stallKept++;
+      }
+      mutex_unlock(&stalled.lock);
+      stressRun.stallQueued = end - start;   // From the ring head, not from the cursor being checked
+      if (stressRun.stallKept > eventRing.mask + 1) ebbgpio_stress_fail("the stalled reader kept more than a ring");
+      if (stressRun.stallKept + stressRun.stallLost != stressRun.stallQueued)
+         ebbgpio_stress_fail("events of the stalled reader are neither kept nor lost");
+      if ((dispatchPolicy == EBBGPIO_POLICY_QUEUE && stressRun.maxPending > scriptDepth) ||
+          (dispatchPolicy == EBBGPIO_POLICY_DROP && stressRun.maxPending > 1))
+         ebbgpio_stress_fail("more script runs pending than scriptPolicy allows");
+      for (i = 0; i < numButtons; i++){
+         ebbgpio_snapshot(&buttons[i], &snap);
+         if (snap.count[EBBGPIO_STAT_PRESSES] + snap.count[EBBGPIO_STAT_SPURIOUS] > READ_ONCE(buttons[i].seq))
+            ebbgpio_stress_fail("a button has more presses than edges");
+      }
+      stressRun.storms = ebbgpio_stress_storms();
+      if (stormRate && !stressRun.bounceStorms) ebbgpio_stress_fail("the bounce phase triggered no storm");
+      for (phase = 0; phase < EBBGPIO_STRESS_PHASES; phase++)
+         if (stressRun.stalls[phase]) ebbgpio_stress_fail("a phase stalled, see above");
+      stressRun.memDelta = (mem - si_mem_available()) * (PAGE_SIZE / 1024);
+      if (stressRun.memDelta > EBBGPIO_STRESS_MEM_KB) ebbgpio_stress_fail("the run left less memory than it should");
+      printk(KERN_INFO "GPIO_TEST: stress: %llu+%llu+%llu+%llu edges, %u storms, %d max pending scripts, "
+             "stalled reader %u/%u/%u, %ld kB less memory, %u failures\n",
+             stressRun.injected[0], stressRun.injected[1], stressRun.injected[2], stressRun.injected[3],
+             stressRun.storms, stressRun.maxPending, stressRun.stallQueued, stressRun.stallKept, stressRun.stallLost,
+             stressRun.memDelta, stressRun.failures);
+   }
+   for (phase = 0; phase < EBBGPIO_STRESS_PHASES; phase++) benchRun.injected += stressRun.injected[phase];
+   WRITE_ONCE(stressRun.phase, EBBGPIO_STRESS_PHASES);
+   WRITE_ONCE(benchRun.elapsed, ktime_sub(ktime_get(), benchRun.start));
+   ebbgpio_bench_park();
+   return 0;
+}
+
+/** @brief Create the simulated IRQs of bench=1
+ *  @return returns 0 if successful or if bench=0
+ */
+static int ebbgpio_bench_init(void){
+   if (!bench) return 0;
+   if (!numButtons) return -EINVAL;
+   benchDomain = irq_domain_create_sim(NULL, numButtons);
+   if (IS_ERR(benchDomain)){
+      int result = PTR_ERR(benchDomain);
+      benchDomain = NULL;
+      printk(KERN_INFO "GPIO_TEST: bench: failed to create the simulated IRQs: %d\n", result);
+      return result;
+   }
+   return 0;
+}
+
+/** @brief Map the simulated IRQ of a button
+ *  @param b the button
+ *  @return returns the Linux IRQ number or a negative error
+ */
+static int ebbgpio_bench_irq(struct ebbgpio_button *b){
+   unsigned int irq = irq_create_mapping(benchDomain, b->index);
+   return irq ? irq : -ENXIO;
+}
+
+/** @brief Start the injector once all the buttons are up */
+static void ebbgpio_bench_start(void){
+   if (!benchDomain) return;
+   debugfs_create_file("bench", S_IRUGO, ebbgpioDebugfs, NULL, &ebbgpio_bench_fops);
+   if (benchStress){
+      memset(&stressRun, 0, sizeof(stressRun));
+      debugfs_create_file("stress", S_IRUGO, ebbgpioDebugfs, NULL, &ebbgpio_stress_fops);
+   }
+   benchRun.task = kthread_run(benchStress ? ebbgpio_stress_thread : ebbgpio_bench_thread, NULL, "ebbgpio-bench");
+   if (IS_ERR(benchRun.task)){
+      printk(KERN_INFO "GPIO_TEST: bench: failed to start the injector: %ld\n", PTR_ERR(benchRun.task));
+      benchRun.task = NULL;
+   }
+}
+
+/** @brief Stop the injector, before the buttons go away
+ *  @param unused devm action argument, not used
+ */
+static void ebbgpio_bench_stop(void *unused){
+   if (benchRun.task) kthread_stop(benchRun.task);
+   benchRun.task = NULL;
+}
+
+/** @brief Remove the simulated IRQs, after the buttons have freed them
+ *  @param unused devm action argument, not used
+ */
+static void ebbgpio_bench_exit(void *unused){
+   if (benchDomain) irq_domain_remove_sim(benchDomain);
+   benchDomain = NULL;
+}
+#else
+static int ebbgpio_bench_init(void){
+   if (bench) printk(KERN_INFO "GPIO_TEST: bench=1 needs a kernel with CONFIG_IRQ_SIM\n");
+   return bench ? -EOPNOTSUPP : 0;
+}
+static int ebbgpio_bench_irq(struct ebbgpio_button *b){ return -ENXIO; }
+static void ebbgpio_bench_start(void){ }
+static void ebbgpio_bench_stop(void *unused){ }
+static void ebbgpio_bench_exit(void *unused){ }
+#endif
+
+/// This next calls are  mandatory -- they identify the initialization function
+/// and the cleanup function (as above).
+module_init(ebbgpio_init);
+module_exit(ebbgpio_exit);
+